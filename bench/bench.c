@@ -0,0 +1,164 @@
+// Microbenchmarks of row preparation and drawing over the lines of a file,
+// typically a log, and of building frames from a file of C. Built and run by
+// "make bench".
+
+#define main kilo_main
+#include "../kilo.c"
+#undef main
+
+#define BENCH_ROWS 50
+#define BENCH_COLS 200
+
+// Window used to time frames, which are of highlighted C
+#define BENCH_FRAME_ROWS 48
+#define BENCH_FRAME_COLS 160
+
+// Byte at a time version of printable_span() to compare it against.
+size_t printable_span_scalar(const uint8_t* p, size_t len) {
+  size_t j = 0;
+  while((j < len) && IS_PRINTABLE(p[j])) { ++j; }
+  return j;
+}
+
+// Output for render_frame(), which is thrown away.
+ssize_t bench_write(const uint8_t* buf, size_t len) {
+  (void)buf;
+  return len;
+}
+
+struct term_backend bench_backend = { .write = bench_write };
+
+// Replace the rows with the lines of a file, highlighted as the file's name
+// says. Returns the number of bytes in the file.
+size_t bench_load(const char* filename) {
+  for(int i=0; i<E.num_rows; ++i) { editor_free_row(&E.row[i]); }
+  free(E.row);
+  E.num_rows = 0;
+
+  struct file_map fm;
+  if(-1 == file_map_open(&fm, filename, 1)) { die(filename); }
+  const uint8_t* p = fm.data, *end = fm.data + fm.size;
+  E.row = xmalloc(sizeof(erow) * (count_byte(p, fm.size, '\n') + 1));
+  E.syntax = editor_syntax_for_filename(filename);
+  int in_comment = 0;
+  while(p < end) {
+    const uint8_t* nl = memchr(p, '\n', end - p);
+    if(!nl) { nl = end; }
+    erow* row = &E.row[E.num_rows];
+    editor_init_row(row, E.num_rows, p, nl - p);
+    editor_highlight_row(E.syntax, row, in_comment);
+    in_comment = row->hl_open_comment;
+    ++E.num_rows;
+    p = nl + 1;
+  }
+
+  size_t size = fm.size;
+  file_map_close(&fm);
+  return size;
+}
+
+// Set the size of the window drawn by editor_draw_row().
+void bench_window(const char* filename, int rows, int cols) {
+  if(E.num_rows < rows) {
+    fprintf(stderr, "%s: needs at least %d lines\n", filename, rows);
+    exit(EXIT_FAILURE);
+  }
+  E.screen_rows = rows;
+  E.screen_cols = E.text_cols = cols;
+  editor_update_damage();
+}
+
+// Time passes over every row of a span function, returning nanoseconds per
+// byte. The spans are summed so that the work isn't optimised away.
+double bench_span(size_t (*span)(const uint8_t*, size_t), int passes,
+    size_t bytes, uint64_t* sum) {
+  uint64_t t = now_ns();
+  for(int pass=0; pass<passes; ++pass) {
+    for(int i=0; i<E.num_rows; ++i) {
+      erow* row = &E.row[i];
+      for(size_t j=0; j<(size_t)row->size; ) {
+        size_t n = span(&row->chars[j], row->size - j);
+        *sum += n;
+        j += n + 1;
+      }
+    }
+  }
+  return (double)(now_ns() - t) / passes / bytes;
+}
+
+int main(int argc, char** argv) {
+  if(argc < 3) {
+    fprintf(stderr, "usage: %s log-file c-file [passes]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  int passes = (argc > 3) ? atoi(argv[3]) : 20;
+  if(passes < 1) { passes = 1; }
+
+  // Row preparation and drawing over the log
+  size_t size = bench_load(argv[1]);
+  bench_window(argv[1], BENCH_ROWS, BENCH_COLS);
+
+  uint64_t sum = 0;
+  double scalar = bench_span(printable_span_scalar, passes, size, &sum);
+  double span = bench_span(printable_span, passes, size, &sum);
+
+  uint64_t t = now_ns();
+  for(int pass=0; pass<passes; ++pass) {
+    for(int i=0; i<E.num_rows; ++i) { editor_render_row(&E.row[i]); }
+  }
+  double render = (double)(now_ns() - t) / passes / size;
+
+  t = now_ns();
+  int frames = 0;
+  for(int pass=0; pass<passes; ++pass) {
+    for(E.row_off=0; E.row_off + BENCH_ROWS <= E.num_rows;
+        E.row_off += BENCH_ROWS, ++frames) {
+      for(int y=0; y<BENCH_ROWS; ++y) { editor_draw_row(y); }
+    }
+  }
+  double draw = (double)(now_ns() - t) / frames / BENCH_ROWS;
+
+  printf("%s: %d lines, %zu bytes, %d passes (%llu)\n", argv[1],
+      E.num_rows, size, passes, (unsigned long long)sum);
+  printf("printable_span, scalar  %8.3f ns/byte\n", scalar);
+  printf("printable_span          %8.3f ns/byte\n", span);
+  printf("editor_render_row       %8.3f ns/byte\n", render);
+  printf("editor_draw_row         %8.1f ns/row\n", draw);
+
+  // Frames of highlighted C, a page at a time so that every cell changes.
+  // Each is built into the back grid by editor_draw_row() and written by
+  // render_frame() as the render thread would.
+  size = bench_load(argv[2]);
+  bench_window(argv[2], BENCH_FRAME_ROWS, BENCH_FRAME_COLS);
+  theme_compile();
+  E.term = &bench_backend;
+
+  struct renderer r;
+  memset(&r, 0, sizeof(r));
+  struct frame_snapshot snap;
+  memset(&snap, 0, sizeof(snap));
+  snap.window_rows = BENCH_FRAME_ROWS;
+
+  uint64_t build = 0, emit = 0, bytes = 0;
+  frames = 0;
+  for(int pass=0; pass<passes; ++pass) {
+    for(E.row_off=0; E.row_off + BENCH_FRAME_ROWS <= E.num_rows;
+        E.row_off += BENCH_FRAME_ROWS, ++frames) {
+      t = now_ns();
+      for(int y=0; y<BENCH_FRAME_ROWS; ++y) { editor_draw_row(y); }
+      grid_copy(&snap.grid, &E.back);
+      uint64_t built = now_ns();
+      render_frame(&r, &snap);
+      emit += now_ns() - built;
+      build += built - t;
+      bytes += snap.cost.bytes;
+    }
+  }
+
+  printf("%s: %d lines, %zu bytes, %d frames of %dx%d\n", argv[2],
+      E.num_rows, size, frames, BENCH_FRAME_COLS, BENCH_FRAME_ROWS);
+  printf("frame build             %8.2f us/frame\n", build / 1e3 / frames);
+  printf("frame emit              %8.2f us/frame, %llu bytes/frame\n",
+      emit / 1e3 / frames, (unsigned long long)(bytes / frames));
+  return EXIT_SUCCESS;
+}
@@ -6,28 +6,217 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#endif
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 //// DATA TYPES
 
 // Append buffer
 struct abuf {
   uint8_t* buf;
   ssize_t len;
+  ssize_t cap; // bytes allocated for buf
 };
 
 // Initial value for abuf structure.
-#define ABUF_INIT { NULL, 0 }
+#define ABUF_INIT { NULL, 0, 0 }
+
+// A grid of character cells covering the terminal. Each cell has a glyph byte
+// and an attribute byte, held in separate planes so that runs of glyphs can be
+// copied in one go.
+struct screen_grid {
+  int rows, cols;
+  uint8_t* glyphs; // rows * cols glyphs, row by row
+  uint8_t* attrs; // rows * cols attributes, row by row
+};
+
+// A pre-rendered escape sequence
+struct escape {
+  uint8_t len;
+  uint8_t seq[63];
+};
+
+// A colour in a theme
+struct theme_colour {
+  int kind; // one of colour_kinds
+  uint32_t value; // palette index or 0xRRGGBB
+};
+
+// How a highlight token is displayed
+struct theme_style {
+  struct theme_colour fg, bg;
+  int attrs; // THEME_BOLD etc.
+};
+
+// What it cost to draw a frame. The editor thread fills in the first part as
+// it builds the frame and the render thread the rest as it draws it.
+struct frame_cost {
+  uint64_t scroll; // editor_scroll() and working out what's damaged (ns)
+  uint64_t draw; // drawing rows and bars into the back grid (ns)
+  uint64_t allocs; // allocations made building the frame
+  uint64_t emit; // diffing against what's on the terminal (ns)
+  uint64_t write; // writing to the terminal (ns)
+  uint64_t bytes; // written to the terminal
+  uint64_t rows; // rows which had to be redrawn
+  uint64_t escapes; // escape sequences written
+};
+
+// A frame published by the editor thread for the render thread to draw. Once
+// published, a snapshot is only touched by the render thread.
+struct frame_snapshot {
+  struct screen_grid grid; // window, status bar and message bar
+  int window_rows; // rows of the grid in the scrolling window
+  int cursor_y, cursor_x; // cursor position (0-based)
+  int scroll_delta; // lines the window has scrolled since the last snapshot
+  int repaint; // the terminal must be repainted from scratch
+  int caps; // TERM_CAP_* supported by the terminal
+  struct frame_cost cost; // of building the frame, and of any it replaced
+};
+
+// The render thread, which writes frames to the terminal
+struct renderer {
+  pthread_t thread;
+  int running;
+
+  // Protects pending, has_pending and stop and is signalled when they change
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct frame_snapshot pending; // latest snapshot not yet drawn
+  int has_pending;
+  int stop;
+
+  // Owned by the render thread
+  struct frame_snapshot current; // snapshot being drawn
+  struct screen_grid front; // what is on the terminal
+  int front_valid; // front is only valid once the terminal has been cleared
+  int cursor_y, cursor_x; // cursor position as last emitted, -1 if unknown
+  struct abuf out; // kept between frames so that drawing doesn't allocate
+  int drawing; // a snapshot is being drawn
+  int lockstep; // render_publish() waits for each snapshot to be drawn
+
+  // Ring of the costs of the last KILO_COST_FRAMES frames drawn, protected by
+  // lock. The next is written to costs[num_costs % KILO_COST_FRAMES].
+  struct frame_cost* costs;
+  uint64_t num_costs; // frames drawn
+
+  // How quickly the terminal accepts output. Once a write has had to wait,
+  // the terminal is taken to be congested for KILO_CONGESTION_HOLD, during
+  // which frames are drawn without syntax colours and limited to what it can
+  // take in KILO_CONGESTED_FRAME.
+  uint64_t bandwidth; // estimated bytes per second while congested
+  uint64_t last_stall; // when a write last had to wait (ns), 0 if never
+  struct screen_grid plain; // snapshot with colours removed
+
+  // Totals for the statistics report
+  uint64_t bytes_written;
+  uint64_t write_time; // in render_write() (ns)
+  uint64_t blocked_time; // waiting for the terminal to accept output (ns)
+  int stalls; // frames whose writes had to wait
+  int plain_frames; // frames drawn without colours
+  int partial_frames; // frames cut short to stay within budget
+};
+
+// A terminal for the editor to run in. Keys are read from it and the render
+// thread writes frames to it. Normally this is the controlling terminal but
+// --headless uses a terminal emulated in memory.
+struct term_backend {
+  // Enter raw mode and restore the terminal on exit
+  void (*open)(void);
+  void (*close)(void);
+
+  // Size of the terminal. Returns -1 iff there was an error.
+  int (*get_size)(int* rows, int* cols);
+
+  // Read input, waiting about a decisecond for some. Returns 0 if none came,
+  // or -1 with errno set.
+  ssize_t (*read)(uint8_t* buf, size_t len);
+
+  // Wait up to timeout milliseconds for input. Returns as poll() does.
+  int (*input_pending)(int timeout);
+
+  // Write output, which may fail with EAGAIN if the terminal is backed up, in
+  // which case wait_writable() waits until it isn't.
+  ssize_t (*write)(const uint8_t* buf, size_t len);
+  int (*wait_writable)(void);
+
+  // Find out which optional features the terminal supports
+  void (*query)(void);
+};
+
+// A terminal emulated in memory for --headless. It understands the escape
+// sequences kilo emits, and records how many bytes each frame took.
+struct vt_terminal {
+  struct screen_grid screen; // glyphs only, attributes are ignored
+  int y, x; // cursor position
+  int wrap_pending; // the last column was written to
+  int top, bottom; // scrolling region, bottom exclusive
+  uint8_t last; // last character written, for REP
+
+  // Escape sequence parser
+  int state; // VT_GROUND etc.
+  int params[16];
+  int num_params;
+  char prefix; // private parameter prefix of a CSI sequence, or 0
+  char intermediate; // intermediate byte of a CSI sequence, or 0
+
+  ssize_t* frames; // bytes written for each frame
+  int num_frames, cap_frames;
+};
+
+// Terminal state tracked while emitting a frame
+struct emit_state {
+  int y, x; // cursor position, -1 if unknown
+  int attr; // current cell attribute, -1 if unknown
+  int caps; // TERM_CAP_* supported by the terminal
+};
+
+// Lexer state at some point within a row, so that highlighting can be resumed
+// there.
+struct hl_state {
+  int in_comment; // within a multiline comment
+  int in_string; // terminating character of the current string, or 0
+  int prev_sep; // was the previous character a separator?
+  int skip; // bytes already highlighted by a token which started earlier
+  int line_comment; // the rest of the row is a comment
+  int prev_hl; // token of the byte before
+};
+
+// A piece of a long row which is rendered and highlighted on its own. The
+// rendered bytes of all chunks are kept contiguous in the row's render and hl
+// arrays.
+struct row_chunk {
+  int start; // offset of first byte in chars
+  int len; // number of bytes in chars
+  int r_start; // offset of first byte in render and hl
+  int r_len; // number of bytes in render and hl
+  int tabs; // number of tabs within the chunk
+  int phase; // r_start % KILO_TAB_STOP when the chunk was last rendered
+  int dirty; // chunk needs to be rendered and highlighted again
+  struct hl_state hl_start; // lexer state at r_start
+};
 
 // A row of display text
 typedef struct erow {
@@ -38,8 +227,134 @@ typedef struct erow {
   uint8_t* render;
   uint8_t* hl; // token types for each byte in render
   int hl_open_comment; // does this row end in an un-closed multiline comment?
+  int has_controls; // render may hold bytes which aren't printable
+
+  // Rendered x-position of every KILO_COL_MARK_STEP'th byte, for rows at
+  // least KILO_COL_MARK_MIN bytes long. Marks are computed as they're needed
+  // and only the first num_col_marks are valid.
+  int* col_marks;
+  int num_col_marks;
+  int cap_col_marks;
+
+  int wrap_lines; // screen lines taken when soft wrapped, 0 if not known
+
+  // Rows at least KILO_CHUNK_MIN bytes long are split into chunks so that an
+  // edit only re-renders and re-highlights the part of the row around it.
+  struct row_chunk* chunks;
+  int num_chunks;
 } erow;
 
+// Prefix sums of the screen lines each row takes up when soft wrapped, kept
+// as a Fenwick tree so that finding the row on a given screen line is
+// O(log n). It is rebuilt lazily when rows are added or removed, or the width
+// changes.
+struct wrap_index {
+  int* tree; // 1-based Fenwick tree over rows
+  int n; // number of rows in the tree
+  int cap; // size of tree
+  int width; // width rows were wrapped at
+  int valid; // the tree matches the rows
+};
+
+// A read-only view of a file's contents. Regular files are mmap()-ed, anything
+// else is read into a malloc()-ed buffer.
+struct file_map {
+  uint8_t* data;
+  uint64_t size;
+  int mapped; // non-zero if data was mmap()-ed
+  struct stat st;
+};
+
+// An index of the offsets at which each line of a file starts. The starts array
+// either points into an mmap()-ed sidecar file or is a malloc()-ed array owned
+// by the index.
+struct line_index {
+  uint64_t* starts;
+  uint64_t num_lines;
+  uint64_t cap; // capacity of starts if malloc()-ed, 0 if mapped
+  void* map; // mapped sidecar, if any
+  size_t map_len;
+};
+
+// Header of a sidecar line index file. The array of line starts follows
+// immediately.
+struct line_index_header {
+  char magic[8];
+  uint64_t file_size; // size of the file when indexed
+  int64_t mtime_sec; // modification time of the file when indexed
+  int64_t mtime_nsec;
+  uint64_t sample_hash; // hash of sampled blocks within the indexed bytes
+  uint64_t num_lines;
+};
+
+// A file being loaded in the background. The fields following target_line are
+// shared with the loading thread and protected by the loader pool's lock.
+struct file_loader {
+  char* filename;
+  struct editor_syntax* syntax; // highlighting rules to load rows with
+  uint64_t target_line; // line to seek to (1-based) or 0 if none
+
+  int state; // one of enum loader_states
+  int news; // non-zero if state has changed since the editor last looked
+  uint64_t target_offset; // offset of target line, once found
+  uint64_t found_line; // line (0-based) at target_offset, once found
+  erow* rows; // loaded rows, once done
+  int num_rows;
+  struct line_index idx; // index of loaded file, once done
+  int err; // errno if loading failed
+};
+
+// A small pool of threads which load files in the background.
+struct loader_pool {
+  pthread_mutex_t lock;
+  struct file_loader** jobs; // queue of loaders waiting for a thread
+  int num_jobs, next_job;
+  int num_threads; // number of running threads
+  int news; // non-zero if any loader has news
+};
+
+// Per-buffer editor state. The current buffer's state lives in the editor
+// configuration itself and is stashed here when switching to another buffer.
+struct editor_buffer {
+  int cx, cy, desired_rx, rx;
+  int row_off, col_off;
+  int wrap_sub;
+  int wrap_width; // width the rows' wrap_lines were counted at
+  int dirty;
+  int num_rows;
+  erow* row;
+  char* filename;
+  struct editor_syntax* syntax;
+  struct file_loader* loader;
+  int line_base;
+  uint64_t window_start;
+  int window_loaded;
+  int save_queued; // save once the save in flight is done, kept here even
+                   // for the current buffer
+};
+
+// Start-up and load-path statistics gathered for --stats. Times are in
+// nanoseconds and are summed over every thread doing the work.
+struct editor_stats {
+  int enabled;
+  uint64_t start; // time at which kilo started
+  uint64_t init; // enable_raw_mode() and init_editor()
+  uint64_t read; // mapping or reading files
+  uint64_t split; // finding line starts
+  uint64_t render; // editor_update_row() and its equivalents
+  uint64_t highlight; // editor_update_syntax() and its equivalents
+  uint64_t first_refresh; // the first editor_refresh_screen()
+  uint64_t first_frame; // time from start to the first frame being written
+  uint64_t loaded; // time from start to all files being loaded
+  uint64_t allocs; // number of allocations
+  uint64_t alloc_bytes; // bytes requested by allocations
+  int frames; // number of screen refreshes
+  uint64_t frame_allocs; // allocations made by the last screen refresh
+  int alloc_frames; // number of screen refreshes which allocated
+  int coalesced_frames; // frames replaced before the render thread drew them
+  int skipped_frames; // frames not drawn because more input was waiting
+};
+
 // Syntax highlighting flags
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
@@ -55,6 +370,26 @@ struct editor_syntax {
   char **keywords; // NULL-terminated array of keywords (2nd-ary term. with "|")
 };
 
+// Everything shown in the status bar. It is only drawn again when this
+// changes.
+struct status_key {
+  char filename[24]; // only the first 20 bytes are shown
+  int dirty;
+  int num_rows;
+  int cy;
+  struct editor_syntax* syntax;
+  int loading, line_base;
+  int cur_buffer, num_buffers;
+  int cols;
+};
+
+// A line number formatted for the gutter, which is width cells wide
+struct gutter_label {
+  int number; // -1 if none
+  int width;
+  uint8_t text[12];
+};
+
 // The state of our editor.
 struct editor_config {
   // Original terminal config on launch.
@@ -77,7 +412,8 @@ struct editor_config {
   // Current scroll offset.
   int row_off, col_off;
 
-  // Non zero if buffer has been modified w.r.t. the file on disk.
+  // Non zero if buffer has been modified w.r.t. the file on disk. Incremented
+  // on each modification.
   int dirty;
 
   // Number of rows in file
@@ -92,14 +428,127 @@ struct editor_config {
   // Status message displayed to user
   char status_msg[80];
 
-  // When status message was last shown
-  time_t status_msg_time;
+  // When the status message times out (ns), or 0 if it doesn't, and whether
+  // it has changed since the message bar was drawn
+  uint64_t status_msg_expiry;
+  int status_msg_changed;
+
+  // What the status bar was last drawn showing
+  struct status_key status_key;
 
   // Syntax highlighting information for current file
   struct editor_syntax* syntax;
 
-  // Flag indicating the terminal has resized
-  int term_resized;
+  // Resizes are read from resize_fd, a signalfd, where there is one and
+  // otherwise flagged in term_resized by the SIGWINCH handler. They're laid
+  // out before the next frame is drawn, as many as arrived in one go.
+  int resize_fd;
+  volatile sig_atomic_t term_resized;
+  int resize_pending;
+
+  // Background loader for the buffer, NULL if none. The buffer is read-only
+  // until loading completes.
+  struct file_loader* loader;
+
+  // Line number within the file of the first row while loading, -1 if not yet
+  // known.
+  int line_base;
+
+  // Offset within the file of the first row while loading
+  uint64_t window_start;
+
+  // Non-zero if the rows hold a window onto the file being loaded
+  int window_loaded;
+
+  // All open buffers. The state of the current one is held above.
+  struct editor_buffer* buffers;
+  int num_buffers, cur_buffer;
+
+  // Threads loading files in the background
+  struct loader_pool pool;
+
+  // Non-zero while prompting the user for input
+  int prompting;
+
+  // Non-zero once the terminal's input has ended, which only happens when
+  // headless
+  int input_ended;
+
+  // Process writing a buffer in the background, 0 if none, and the buffer
+  // being written
+  pid_t save_pid;
+  int save_buffer;
+
+  // Value of dirty and length of buffer when the background save started
+  int save_dirty;
+  int64_t save_len;
+
+  // Flag indicating a child process has exited
+  volatile sig_atomic_t child_exited;
+
+  // Instrumentation for --stats
+  struct editor_stats stats;
+
+  // One flag per line of the editor window which is set if that line needs
+  // to be redrawn
+  uint8_t* damage;
+  int damage_rows;
+
+  // Non-zero if the whole screen needs to be redrawn
+  int full_redraw;
+
+  // Scroll position and width used for the last frame
+  int last_row_off, last_col_off, last_cols;
+  int last_cursor_y; // screen line of the cursor in the last frame
+  int last_cy; // cursor row in the last frame
+
+  // Line number gutter. gutter is its width, which is 0 if it's off, and
+  // text_cols the width left for text. Labels are kept per screen line when
+  // numbers are absolute, and move with scrolling. Relative numbers are kept
+  // by distance from the cursor row.
+  int line_numbers; // LINE_NUMBERS_*
+  int gutter;
+  int text_cols;
+  struct gutter_label* gutter_labels; // one per line of the editor window
+
+  // Lines the terminal's window region must be scrolled up (or down, if
+  // negative) by at the start of the next frame
+  int scroll_delta;
+
+  // What the screen should show. This covers the editor window plus the
+  // status and message bars and is published to the render thread, which
+  // works out what must be written to the terminal.
+  struct screen_grid back;
+  struct renderer render;
+
+  // The terminal must be repainted from scratch on the next frame
+  int repaint;
+
+  // Soft wrapping. When on, the top of the window is screen line wrap_sub of
+  // row row_off, which is screen line wrap_top counting from the start of the
+  // file.
+  int wrap_mode;
+  int wrap_sub;
+  int wrap_top, last_wrap_top;
+  struct wrap_index wrap;
+
+  // Show what recent frames cost over the top right of the window
+  int cost_overlay;
+
+  // Minimum time between frames and when the last one was drawn (ns)
+  uint64_t frame_interval;
+  uint64_t last_frame;
+
+  // Whether something has changed which needs a frame drawing
+  int frame_pending;
+
+  // Optional features the terminal supports (TERM_CAP_*)
+  int term_caps;
+
+  // The terminal we're running in, and for the controlling terminal where
+  // frames are written, which is non-blocking if possible
+  struct term_backend* term;
+  int out_fd;
 };
 
 //// GLOBALS
@@ -107,6 +556,9 @@ struct editor_config {
 // Short, pithy name for "global editor".
 struct editor_config E;
 
+// The terminal emulated by --headless
+struct vt_terminal VT;
+
 // Filetype tables
 char *C_HL_extensions[] = { ".c", ".h", ".cpp", ".hpp", NULL };
 char *C_HL_keywords[] = {
@@ -143,6 +595,79 @@ struct editor_syntax HLDB[] = {
 // Number of times quit command must be issued if the buffer is dirty
 #define KILO_QUIT_TIMES 3
 
+// Files smaller than this are not worth keeping a sidecar line index for
+#define KILO_INDEX_MIN_SIZE (1 << 20)
+
+// Number and size of blocks sampled to detect a change in an indexed file
+#define KILO_INDEX_SAMPLES 16
+#define KILO_INDEX_SAMPLE_SIZE 4096
+
+// Magic number at the start of a sidecar line index
+#define KILO_INDEX_MAGIC "KILOIDX1"
+
+// Number of lines either side of the target to load when opening a file at a
+// particular line or offset
+#define KILO_WINDOW_LINES 500
+
+// Size of block used when counting newlines
+#define KILO_COUNT_BLOCK (1 << 16)
+
+// Maximum number of threads loading files in the background
+#define KILO_LOADER_THREADS 4
+
+// Buffers at least this large are saved by a forked child process
+#define KILO_BGSAVE_MIN_SIZE (1 << 20)
+
+// Rows at least this long keep column marks every KILO_COL_MARK_STEP bytes
+#define KILO_COL_MARK_MIN 4096
+#define KILO_COL_MARK_STEP 256
+
+// Rows at least this long are rendered and highlighted in chunks of around
+// KILO_CHUNK_SIZE bytes. Edits within KILO_CHUNK_MARGIN bytes of the start of
+// a chunk also re-highlight the chunk before in case a token spans both.
+#define KILO_CHUNK_MIN (1 << 16)
+#define KILO_CHUNK_SIZE (1 << 14)
+#define KILO_CHUNK_MARGIN 32
+
+// A congested terminal stays so for this long after output last had to wait
+// for it, with frames limited to what it can take in KILO_CONGESTED_FRAME (and
+// at least KILO_CONGESTED_MIN_BYTES). Rows left undrawn are drawn after
+// KILO_CATCH_UP unless a newer frame turns up first. All times are in ns.
+#define KILO_CONGESTION_HOLD 500000000ull
+#define KILO_CONGESTED_FRAME 50000000ull
+#define KILO_CONGESTED_MIN_BYTES 512
+#define KILO_CATCH_UP 100000000ull
+
+// Number of frames whose costs are kept for the cost overlay
+#define KILO_COST_FRAMES 128
+
+// States of the headless terminal's escape sequence parser
+enum vt_states {
+  VT_GROUND,
+  VT_ESCAPE, // after ESC
+  VT_CSI, // within a control sequence
+  VT_STRING, // within a device control or operating system command string
+  VT_STRING_ESC, // after ESC within a string
+};
+
+// What the line number gutter shows
+enum line_number_modes {
+  LINE_NUMBERS_OFF = 0,
+  LINE_NUMBERS_ABSOLUTE,
+  LINE_NUMBERS_RELATIVE, // distance from the cursor row, which is absolute
+};
+
+// Default maximum number of frames drawn per second
+#define KILO_MAX_FPS 60
+
+// Cell attribute flags. The low bits of a cell's attribute hold its highlight
+// token.
+#define CELL_HL_MASK 0x0f
+#define CELL_REVERSE 0x80
+
+// Whether a byte is displayed as itself. This is isprint() in the C locale.
+#define IS_PRINTABLE(c) (((c) >= ' ') && ((c) < 0x7f))
+
 // Byte corresponding to CTRL-<key>
 #define CTRL_KEY(key) ((key) & 0x1f)
 
@@ -170,6 +695,20 @@ enum special_keys {
   PAGE_DOWN,
 
   TERM_RESIZE_KEY,
+  LOADER_KEY, // the background loader has news
+  CHILD_EXIT_KEY, // a child process has exited
+  TERM_REPLY_KEY, // the terminal replied to a query
+  TIMER_KEY, // the status message timed out
+  INPUT_END_KEY, // there will be no more input
+};
+
+// Background loader states
+enum loader_states {
+  LOADER_IDLE = 0,
+  LOADER_SEEKING, // counting lines to find the target
+  LOADER_LOADING, // target found, loading the whole file
+  LOADER_DONE, // rows are ready for the editor to adopt
+  LOADER_FAILED,
 };
 
 // Syntax highlighting tokens
@@ -182,45 +721,1163 @@ enum highlight_tokens {
   HL_STRING,
   HL_NUMBER,
   HL_MATCH, // search match
+  HL_LINE_NUMBER,
+
+  HL_TOKENS // number of highlight tokens
+};
+
+// Kinds of theme colour
+enum colour_kinds {
+  COLOUR_DEFAULT = 0, // the terminal's default
+  COLOUR_16, // one of the 16 basic colours
+  COLOUR_256, // an index into the 256 colour palette
+  COLOUR_RGB, // 24-bit colour
 };
 
-//// PROTOTYPES
+// Text attributes in a theme style
+#define THEME_BOLD (1<<0)
+#define THEME_ITALIC (1<<1)
+#define THEME_UNDERLINE (1<<2)
+#define THEME_REVERSE (1<<3)
+
+// Optional terminal features, found by terminal_caps_from_env() and by
+// querying the terminal
+#define TERM_CAP_SYNC (1<<0) // synchronized output (DEC mode 2026)
+#define TERM_CAP_ECH (1<<1) // erase characters, CSI X
+#define TERM_CAP_ICH (1<<2) // insert and delete characters, CSI @ and CSI P
+#define TERM_CAP_REP (1<<3) // repeat the previous character, CSI b
+
+//// PROTOTYPES
+
+// a callback taking the current input and last key pressed
+typedef void (*prompt_cb)(char*, int);
+
+char* editor_prompt(char* prompt, prompt_cb cb);
+int editor_loader_has_news(void);
+int editor_is_read_only(void);
+void editor_save(void);
+void editor_switch_buffer(int i);
+void editor_set_status_message(const char* fmt, ...);
+int editor_expire_message(void);
+void editor_damage_row(int file_row);
+void editor_syntax_changed(erow* row, int was_open);
+void editor_damage_rows_from(int file_row);
+void editor_damage_all(void);
+void editor_update_screen(void);
+void editor_refresh_screen(void);
+void editor_draw_cost_overlay(void);
+int write_all(int fd, const uint8_t* buf, size_t len);
+void terminal_handle_reply(char kind, const char* params, char final);
+
+//// UTILITY
+
+// Print an error message and terminate the program with an error status.
+void die(const char* s) {
+  // Clear screen and re-position cursor.
+  write(STDOUT_FILENO, "\x1b[2J\x1b[H", 7);
+
+  perror(s);
+  exit(EXIT_FAILURE);
+}
+
+// Count the occurrences of a byte in a block of bytes.
+uint64_t count_byte(const uint8_t* p, size_t len, uint8_t byte) {
+  uint64_t n = 0;
+
+#ifdef __SSE2__
+  const __m128i b = _mm_set1_epi8(byte);
+  for(; len >= 16; p += 16, len -= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, b)));
+  }
+#endif
+
+  for(; len > 0; ++p, --len) {
+    if(*p == byte) { ++n; }
+  }
+
+  return n;
+}
+
+// Length of the run of printable bytes at the start of a block of bytes.
+size_t printable_span(const uint8_t* p, size_t len) {
+  size_t j = 0;
+
+#ifdef __SSE2__
+  // Adding 0x60 takes the printable bytes, ' ' to '~', to the signed bytes
+  // -128 to -34 and everything else above them, so one signed comparison
+  // finds the bytes which aren't printable.
+  const __m128i bias = _mm_set1_epi8(0x60), last = _mm_set1_epi8(-34);
+  for(; j + 16 <= len; j += 16) {
+    __m128i v = _mm_add_epi8(_mm_loadu_si128((const __m128i*)&p[j]), bias);
+    int mask = _mm_movemask_epi8(_mm_cmpgt_epi8(v, last));
+    if(mask) { return j + __builtin_ctz(mask); }
+  }
+#endif
+
+  while((j < len) && IS_PRINTABLE(p[j])) { ++j; }
+  return j;
+}
+
+//// MEMORY
+
+// Count an allocation of n bytes. Allocations are made from several threads.
+void stats_count_alloc(size_t n) {
+  __sync_fetch_and_add(&E.stats.allocs, 1);
+  __sync_fetch_and_add(&E.stats.alloc_bytes, n);
+}
+
+// Allocate memory, terminating the program if there is none. Zero length
+// allocations are rounded up so that NULL always indicates failure.
+void* xmalloc(size_t n) {
+  stats_count_alloc(n);
+  void* p = malloc(n ? n : 1);
+  if(p == NULL) { die("malloc"); }
+  return p;
+}
+
+void* xcalloc(size_t count, size_t n) {
+  stats_count_alloc(count * n);
+  void* p = calloc(count ? count : 1, n ? n : 1);
+  if(p == NULL) { die("calloc"); }
+  return p;
+}
+
+void* xrealloc(void* ptr, size_t n) {
+  stats_count_alloc(n);
+  void* p = realloc(ptr, n ? n : 1);
+  if(p == NULL) { die("realloc"); }
+  return p;
+}
+
+char* xstrdup(const char* str) {
+  size_t n = strlen(str) + 1;
+  char* p = xmalloc(n);
+  memcpy(p, str, n);
+  return p;
+}
+
+//// STATISTICS
+
+// Current value of the monotonic clock in nanoseconds.
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Start timing an operation. Returns 0 if statistics are disabled.
+uint64_t stats_begin(void) {
+  return E.stats.enabled ? now_ns() : 0;
+}
+
+// Add the time since start, as returned by stats_begin(), to a statistic.
+void stats_end(uint64_t* stat, uint64_t start) {
+  if(start == 0) { return; }
+  __sync_fetch_and_add(stat, now_ns() - start);
+}
+
+// Peak resident set size in bytes.
+uint64_t stats_peak_rss(void) {
+  struct rusage ru;
+  if(-1 == getrusage(RUSAGE_SELF, &ru)) { return 0; }
+  return (uint64_t)ru.ru_maxrss * 1024; // ru_maxrss is in KiB on Linux
+}
+
+// Print the statistics report to stderr.
+void stats_report(void) {
+  struct editor_stats* st = &E.stats;
+  if(!st->enabled) { return; }
+
+  fprintf(stderr, "kilo statistics\n");
+  fprintf(stderr, "  %-34s %12.3f ms\n", "enable_raw_mode + init_editor",
+      st->init / 1e6);
+  fprintf(stderr, "  %-34s %12.3f ms\n", "file read", st->read / 1e6);
+  fprintf(stderr, "  %-34s %12.3f ms\n", "line splitting", st->split / 1e6);
+  fprintf(stderr, "  %-34s %12.3f ms\n", "editor_update_row", st->render / 1e6);
+  fprintf(stderr, "  %-34s %12.3f ms\n", "editor_update_syntax",
+      st->highlight / 1e6);
+  fprintf(stderr, "  %-34s %12.3f ms\n", "first editor_refresh_screen",
+      st->first_refresh / 1e6);
+  fprintf(stderr, "  %-34s %12.3f ms\n", "start to first frame",
+      st->first_frame / 1e6);
+  fprintf(stderr, "  %-34s %12.3f ms\n", "start to all files loaded",
+      st->loaded / 1e6);
+  fprintf(stderr, "  %-34s %12llu\n", "frames", (unsigned long long)st->frames);
+  fprintf(stderr, "  %-34s %12llu\n", "frames which allocated",
+      (unsigned long long)st->alloc_frames);
+  fprintf(stderr, "  %-34s %12llu\n", "frames skipped for input",
+      (unsigned long long)st->skipped_frames);
+  fprintf(stderr, "  %-34s %12llu\n", "frames coalesced when drawing",
+      (unsigned long long)st->coalesced_frames);
+
+  // the render thread has stopped by now
+  struct renderer* r = &E.render;
+  fprintf(stderr, "  %-34s %12.1f KiB\n", "written to terminal",
+      r->bytes_written / 1024.0);
+  fprintf(stderr, "  %-34s %12.3f ms\n", "writing to terminal",
+      r->write_time / 1e6);
+  fprintf(stderr, "  %-34s %12.3f ms\n", "waiting for terminal",
+      r->blocked_time / 1e6);
+  fprintf(stderr, "  %-34s %12llu\n", "frames which waited",
+      (unsigned long long)r->stalls);
+  fprintf(stderr, "  %-34s %12llu\n", "frames drawn without colour",
+      (unsigned long long)r->plain_frames);
+  fprintf(stderr, "  %-34s %12llu\n", "frames cut short",
+      (unsigned long long)r->partial_frames);
+  fprintf(stderr, "  %-34s %12llu (%.1f MiB)\n", "allocations",
+      (unsigned long long)st->allocs, st->alloc_bytes / (1024.0 * 1024.0));
+  fprintf(stderr, "  %-34s %12.1f MiB\n", "peak RSS",
+      stats_peak_rss() / (1024.0 * 1024.0));
+}
+
+// Record that all files have been loaded.
+void stats_loaded(void) {
+  if(E.stats.enabled && !E.stats.loaded) {
+    E.stats.loaded = now_ns() - E.stats.start;
+  }
+}
+
+//// APPEND BUFFER
+
+// Make sure there is room to append len bytes to an append buffer. The buffer
+// grows geometrically so that appending is amortised constant time.
+void ab_reserve(struct abuf *ab, ssize_t len) {
+  if(ab->len + len < ab->len) {
+    die("overflow?");
+  }
+  if(ab->len + len <= ab->cap) { return; }
+
+  ssize_t cap = ab->cap ? ab->cap : 256;
+  while(cap < ab->len + len) {
+    if(cap * 2 < cap) { die("overflow?"); }
+    cap *= 2;
+  }
+
+  ab->buf = xrealloc(ab->buf, cap);
+  ab->cap = cap;
+}
+
+// Append an array of bytes to an append buffer which is known to have room
+// for them.
+void ab_append_unchecked(struct abuf *ab, const uint8_t *s, ssize_t len) {
+  assert(ab->len + len <= ab->cap);
+  memcpy(&ab->buf[ab->len], s, len);
+  ab->len += len;
+}
+
+// Append an array of bytes to an append buffer.
+void ab_append(struct abuf *ab, const uint8_t *s, ssize_t len) {
+  ab_reserve(ab, len);
+  ab_append_unchecked(ab, s, len);
+}
+
+// Empty an append buffer, keeping its memory for reuse.
+void ab_reset(struct abuf *ab) {
+  ab->len = 0;
+}
+
+void ab_free(struct abuf *ab) {
+  free(ab->buf);
+  ab->buf = NULL;
+  ab->len = ab->cap = 0;
+}
+
+//// THEMES
+
+// Names of the highlight tokens in a theme file
+const char* theme_token_names[HL_TOKENS] = {
+  "normal", "comment", "mlcomment", "keyword1", "keyword2", "string",
+  "number", "match", "linenr",
+};
+
+// Names of the 8 basic colours. The bright versions are prefixed "bright-".
+const char* theme_colour_names[8] = {
+  "black", "red", "green", "yellow", "blue", "magenta", "cyan", "white",
+};
+
+// RGB values of the 16 basic colours (as xterm has them)
+const uint32_t theme_basic_rgb[16] = {
+  0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd,
+  0xe5e5e5, 0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff,
+  0x00ffff, 0xffffff,
+};
+
+// The theme in use. The default is kilo's original colours.
+struct theme_style theme[HL_TOKENS] = {
+  [HL_COMMENT] = { { COLOUR_16, 6 }, { COLOUR_DEFAULT, 0 }, 0 },
+  [HL_MLCOMMENT] = { { COLOUR_16, 6 }, { COLOUR_DEFAULT, 0 }, 0 },
+  [HL_KEYWORD1] = { { COLOUR_16, 3 }, { COLOUR_DEFAULT, 0 }, 0 },
+  [HL_KEYWORD2] = { { COLOUR_16, 2 }, { COLOUR_DEFAULT, 0 }, 0 },
+  [HL_STRING] = { { COLOUR_16, 5 }, { COLOUR_DEFAULT, 0 }, 0 },
+  [HL_NUMBER] = { { COLOUR_16, 1 }, { COLOUR_DEFAULT, 0 }, 0 },
+  [HL_MATCH] = { { COLOUR_16, 4 }, { COLOUR_DEFAULT, 0 }, 0 },
+  [HL_LINE_NUMBER] = { { COLOUR_16, 8 }, { COLOUR_DEFAULT, 0 }, 0 },
+};
+
+// Most colourful kind of colour the terminal can display
+int theme_depth = COLOUR_16;
+
+// SGR sequences selecting each cell attribute, compiled once from the theme
+struct escape attr_escapes[256];
+
+// Work out how many colours the terminal can display from the environment.
+int theme_detect_depth(void) {
+  const char* colorterm = getenv("COLORTERM");
+  const char* term = getenv("TERM");
+
+  if(colorterm && (!strcmp(colorterm, "truecolor") ||
+        !strcmp(colorterm, "24bit"))) {
+    return COLOUR_RGB;
+  }
+  if(term && strstr(term, "256color")) { return COLOUR_256; }
+  return COLOUR_16;
+}
+
+// RGB value of an entry in the 256 colour palette.
+uint32_t theme_palette_rgb(int index) {
+  if(index < 16) { return theme_basic_rgb[index]; }
+
+  if(index >= 232) {
+    // grey ramp
+    uint32_t v = 8 + 10 * (index - 232);
+    return (v << 16) | (v << 8) | v;
+  }
+
+  // 6x6x6 colour cube
+  static const uint8_t levels[6] = { 0, 95, 135, 175, 215, 255 };
+  index -= 16;
+  return (levels[index / 36] << 16) | (levels[(index / 6) % 6] << 8) |
+    levels[index % 6];
+}
+
+// Nearest of the 16 basic colours to an RGB value.
+int theme_nearest_basic(uint32_t rgb) {
+  int best = 0;
+  long best_dist = -1;
+  for(int i=0; i<16; ++i) {
+    long dr = (long)((rgb >> 16) & 0xff) - ((theme_basic_rgb[i] >> 16) & 0xff);
+    long dg = (long)((rgb >> 8) & 0xff) - ((theme_basic_rgb[i] >> 8) & 0xff);
+    long db = (long)(rgb & 0xff) - (theme_basic_rgb[i] & 0xff);
+    long dist = dr * dr + dg * dg + db * db;
+    if((best_dist < 0) || (dist < best_dist)) { best = i; best_dist = dist; }
+  }
+  return best;
+}
+
+// Nearest entry of the 6x6x6 colour cube to an RGB value.
+int theme_nearest_cube(uint32_t rgb) {
+  int idx = 16;
+  for(int shift=16, scale=36; shift>=0; shift-=8, scale/=6) {
+    int v = (rgb >> shift) & 0xff;
+    int level = (v < 48) ? 0 : (v < 115) ? 1 : (v - 35) / 40;
+    idx += scale * level;
+  }
+  return idx;
+}
+
+// Append the SGR parameters for a colour to buf, converting it to something
+// the terminal can display. base is 30 for foreground and 40 for background.
+int theme_colour_sgr(char* buf, size_t size, struct theme_colour c, int base) {
+  int kind = c.kind;
+  uint32_t value = c.value;
+
+  // reduce the colour to what the terminal can display
+  if((kind == COLOUR_RGB) && (theme_depth == COLOUR_256)) {
+    kind = COLOUR_256;
+    value = theme_nearest_cube(value);
+  } else if((kind == COLOUR_RGB) && (theme_depth == COLOUR_16)) {
+    kind = COLOUR_16;
+    value = theme_nearest_basic(value);
+  } else if((kind == COLOUR_256) && (value < 16)) {
+    kind = COLOUR_16;
+  } else if((kind == COLOUR_256) && (theme_depth == COLOUR_16)) {
+    kind = COLOUR_16;
+    value = theme_nearest_basic(theme_palette_rgb(value));
+  }
+
+  switch(kind) {
+    case COLOUR_16:
+      return snprintf(buf, size, ";%d",
+          (value < 8) ? base + (int)value : base + 60 + (int)value - 8);
+    case COLOUR_256:
+      return snprintf(buf, size, ";%d;5;%d", base + 8, (int)value);
+    case COLOUR_RGB:
+      return snprintf(buf, size, ";%d;2;%d;%d;%d", base + 8,
+          (int)(value >> 16) & 0xff, (int)(value >> 8) & 0xff,
+          (int)value & 0xff);
+    default:
+      return 0;
+  }
+}
+
+// Compile the SGR sequence for every cell attribute from the theme.
+void theme_compile(void) {
+  for(int attr=0; attr<256; ++attr) {
+    struct escape* e = &attr_escapes[attr];
+    int hl = attr & CELL_HL_MASK;
+    struct theme_style style = (hl < HL_TOKENS) ? theme[hl] : theme[HL_NORMAL];
+
+    // reverse video cells swap the token's colours
+    int attrs = style.attrs;
+    if(attr & CELL_REVERSE) { attrs ^= THEME_REVERSE; }
+
+    char buf[sizeof(e->seq) + 1];
+    int len = snprintf(buf, sizeof(buf), "\x1b[0%s%s%s%s",
+        (attrs & THEME_BOLD) ? ";1" : "", (attrs & THEME_ITALIC) ? ";3" : "",
+        (attrs & THEME_UNDERLINE) ? ";4" : "",
+        (attrs & THEME_REVERSE) ? ";7" : "");
+    len += theme_colour_sgr(&buf[len], sizeof(buf) - len, style.fg, 30);
+    len += theme_colour_sgr(&buf[len], sizeof(buf) - len, style.bg, 40);
+    buf[len++] = 'm';
+
+    memcpy(e->seq, buf, len);
+    e->len = len;
+  }
+}
+
+// Parse a theme colour. Returns 0 on success.
+int theme_parse_colour(const char* s, struct theme_colour* c) {
+  char* end;
+
+  if(!strcmp(s, "default")) {
+    c->kind = COLOUR_DEFAULT;
+    c->value = 0;
+    return 0;
+  }
+
+  if(s[0] == '#') {
+    // strtoul() would let a sign or spaces through
+    if(strlen(s) != 7) { return -1; }
+    for(int i=1; i<7; ++i) {
+      if(!isxdigit((uint8_t)s[i])) { return -1; }
+    }
+    c->value = strtoul(&s[1], NULL, 16);
+    c->kind = COLOUR_RGB;
+    return 0;
+  }
+
+  if(isdigit((uint8_t)s[0])) {
+    c->value = strtoul(s, &end, 10);
+    if((*end != '\0') || (c->value > 255)) { return -1; }
+    c->kind = COLOUR_256;
+    return 0;
+  }
+
+  int bright = !strncmp(s, "bright-", 7);
+  if(bright) { s += 7; }
+  for(int i=0; i<8; ++i) {
+    if(!strcmp(s, theme_colour_names[i])) {
+      c->kind = COLOUR_16;
+      c->value = i + (bright ? 8 : 0);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Parse one line of a theme file:
+//
+//   <token> [fg=<colour>] [bg=<colour>] [bold] [italic] [underline] [reverse]
+//
+// where a colour is "default", a basic colour name such as "red" or
+// "bright-red", a 256 colour palette index or "#rrggbb". Returns 0 on success.
+int theme_parse_line(char* line) {
+  char* word = strtok(line, " \t\r\n");
+  if(!word || (word[0] == '#')) { return 0; }
+
+  int hl = 0;
+  while((hl < HL_TOKENS) && strcmp(word, theme_token_names[hl])) { ++hl; }
+  if(hl == HL_TOKENS) { return -1; }
+
+  struct theme_style style = { { COLOUR_DEFAULT, 0 }, { COLOUR_DEFAULT, 0 }, 0 };
+  while((word = strtok(NULL, " \t\r\n"))) {
+    if(!strncmp(word, "fg=", 3)) {
+      if(theme_parse_colour(&word[3], &style.fg)) { return -1; }
+    } else if(!strncmp(word, "bg=", 3)) {
+      if(theme_parse_colour(&word[3], &style.bg)) { return -1; }
+    } else if(!strcmp(word, "bold")) {
+      style.attrs |= THEME_BOLD;
+    } else if(!strcmp(word, "italic")) {
+      style.attrs |= THEME_ITALIC;
+    } else if(!strcmp(word, "underline")) {
+      style.attrs |= THEME_UNDERLINE;
+    } else if(!strcmp(word, "reverse")) {
+      style.attrs |= THEME_REVERSE;
+    } else {
+      return -1;
+    }
+  }
+
+  theme[hl] = style;
+  return 0;
+}
+
+// Load the theme named by $KILO_THEME, or ~/.config/kilo/theme if that isn't
+// set, and compile it. Tokens the theme doesn't mention keep their default
+// style. Problems are reported in the status message.
+void theme_load(void) {
+  char path[1024] = "";
+  const char* env = getenv("KILO_THEME");
+  const char* home = getenv("HOME");
+
+  theme_depth = theme_detect_depth();
+
+  if(env) {
+    snprintf(path, sizeof(path), "%s", env);
+  } else if(home) {
+    snprintf(path, sizeof(path), "%s/.config/kilo/theme", home);
+  }
+
+  FILE* fp = path[0] ? fopen(path, "r") : NULL;
+  if(fp) {
+    char line[256];
+    int line_no = 0;
+    while(fgets(line, sizeof(line), fp)) {
+      ++line_no;
+      if(theme_parse_line(line)) {
+        editor_set_status_message("%.200s:%d: bad theme line", path, line_no);
+      }
+    }
+    fclose(fp);
+  } else if(env) {
+    editor_set_status_message("Can't open theme %.200s", path);
+  }
+
+  theme_compile();
+}
+
+//// SCREEN GRID
+
+// Resize a grid, blanking its contents.
+void grid_resize(struct screen_grid* g, int rows, int cols) {
+  g->rows = rows;
+  g->cols = cols;
+  g->glyphs = xrealloc(g->glyphs, rows * cols);
+  g->attrs = xrealloc(g->attrs, rows * cols);
+  memset(g->glyphs, ' ', rows * cols);
+  memset(g->attrs, 0, rows * cols);
+}
+
+// Copy one grid to another, resizing the destination to match.
+void grid_copy(struct screen_grid* dst, const struct screen_grid* src) {
+  if((dst->rows != src->rows) || (dst->cols != src->cols)) {
+    grid_resize(dst, src->rows, src->cols);
+  }
+  memcpy(dst->glyphs, src->glyphs, src->rows * src->cols);
+  memcpy(dst->attrs, src->attrs, src->rows * src->cols);
+}
+
+// Blank one row of a grid.
+void grid_clear_row(struct screen_grid* g, int y) {
+  memset(&g->glyphs[y * g->cols], ' ', g->cols);
+  memset(&g->attrs[y * g->cols], 0, g->cols);
+}
+
+// Write bytes into a row of a grid at column x with the given attribute,
+// clipping at the right-hand edge. Returns the number of cells written.
+int grid_put(struct screen_grid* g, int y, int x, const uint8_t* s, int len,
+    uint8_t attr) {
+  if(x + len > g->cols) { len = g->cols - x; }
+  if(len <= 0) { return 0; }
+  memcpy(&g->glyphs[y * g->cols + x], s, len);
+  memset(&g->attrs[y * g->cols + x], attr, len);
+  return len;
+}
+
+// Scroll rows top to bottom (exclusive) of a grid up by n rows, or down if n
+// is negative, blanking the rows exposed.
+void grid_scroll(struct screen_grid* g, int top, int bottom, int n) {
+  int rows = bottom - top;
+  int keep = rows - abs(n);
+  if(keep <= 0) {
+    for(int y=top; y<bottom; ++y) { grid_clear_row(g, y); }
+    return;
+  }
+
+  int from = (n > 0) ? top + n : top, to = (n > 0) ? top : top - n;
+  memmove(&g->glyphs[to * g->cols], &g->glyphs[from * g->cols], keep * g->cols);
+  memmove(&g->attrs[to * g->cols], &g->attrs[from * g->cols], keep * g->cols);
+
+  int exposed = (n > 0) ? bottom - n : top;
+  for(int y=exposed; y<exposed + abs(n); ++y) { grid_clear_row(g, y); }
+}
+
+// Number of bytes needed to move the cursor to a (0-based) position.
+int move_cost(int y, int x) {
+  int cost = 4; // CSI, ';' and 'H'
+  for(int v = y + 1; v > 0; v /= 10) { ++cost; }
+  for(int v = x + 1; v > 0; v /= 10) { ++cost; }
+  return cost;
+}
+
+// Append a cursor movement to a (1-based) screen position
+void ab_append_move(struct abuf *ab, int y, int x) {
+  uint8_t buf[32];
+  int len = snprintf((char*)buf, sizeof(buf), "\x1b[%d;%dH", y, x);
+  ab_append(ab, buf, len);
+}
+
+// Append the SGR sequence selecting a cell attribute.
+void ab_append_attr(struct abuf *ab, uint8_t attr) {
+  ab_append(ab, attr_escapes[attr].seq, attr_escapes[attr].len);
+}
+
+// Number of decimal digits in a non-negative number.
+int num_digits(int n) {
+  int digits = 1;
+  for(; n >= 10; n /= 10) { ++digits; }
+  return digits;
+}
+
+// Append a CSI sequence with a count and final byte. A count of one is left
+// out as that is the default.
+void ab_append_csi_count(struct abuf *ab, int n, char final) {
+  uint8_t buf[16];
+  int len = (n == 1) ? snprintf((char*)buf, sizeof(buf), "\x1b[%c", final)
+                     : snprintf((char*)buf, sizeof(buf), "\x1b[%d%c", n, final);
+  ab_append(ab, buf, len);
+}
+
+// Move the terminal cursor, if it isn't already there. When the cursor's
+// position is known, relative movements are used if they are shorter than
+// moving to an absolute position.
+void emit_move(struct abuf *ab, struct emit_state* st, int y, int x) {
+  if((st->y == y) && (st->x == x)) { return; }
+
+  if((st->y >= 0) && (st->x >= 0)) {
+    int dy = y - st->y, dx = x - st->x;
+
+    // going down by line feeds needs a carriage return to reach column 0
+    int use_lf = (dy > 0) && (x == 0) && (dy + 1 < 3 + num_digits(dy));
+
+    int cost = 0;
+    if(use_lf) {
+      cost = dy + 1;
+    } else {
+      if(dy != 0) { cost += 2 + ((abs(dy) > 1) ? num_digits(abs(dy)) : 0) + 1; }
+      if((dx != 0) && (x == 0)) {
+        cost += 1;
+      } else if(dx == -1) {
+        cost += 1;
+      } else if(dx != 0) {
+        cost += 2 + ((abs(dx) > 1) ? num_digits(abs(dx)) : 0) + 1;
+      }
+    }
+
+    if(cost < move_cost(y, x)) {
+      if(use_lf) {
+        ab_append(ab, U8("\r"), 1);
+        for(int j=0; j<dy; ++j) { ab_append(ab, U8("\n"), 1); }
+      } else {
+        if(dy != 0) { ab_append_csi_count(ab, abs(dy), (dy > 0) ? 'B' : 'A'); }
+        if((dx != 0) && (x == 0)) {
+          ab_append(ab, U8("\r"), 1);
+        } else if(dx == -1) {
+          ab_append(ab, U8("\b"), 1);
+        } else if(dx != 0) {
+          ab_append_csi_count(ab, abs(dx), (dx > 0) ? 'C' : 'D');
+        }
+      }
+      st->y = y;
+      st->x = x;
+      return;
+    }
+  }
+
+  ab_append_move(ab, y + 1, x + 1);
+  st->y = y;
+  st->x = x;
+}
+
+// Emit n cells of one attribute, which is already selected. Runs of a
+// repeated character are sent with REP, or blanks erased with ECH, when the
+// terminal supports them and it is shorter.
+void emit_run(struct abuf *ab, struct emit_state* st, const uint8_t* glyphs,
+    int n) {
+  int x = 0;
+  while(x < n) {
+    int end = x + 1;
+    while((end < n) && (glyphs[end] == glyphs[x])) { ++end; }
+    int len = end - x;
+
+    if((st->caps & TERM_CAP_REP) && IS_PRINTABLE(glyphs[x]) &&
+        (1 + 3 + num_digits(len - 1) < len)) {
+      ab_append(ab, &glyphs[x], 1);
+      ab_append_csi_count(ab, len - 1, 'b');
+    } else if((st->caps & TERM_CAP_ECH) && (glyphs[x] == ' ') &&
+        (st->attr == 0) && (2 * (3 + num_digits(len)) < len)) {
+      // ECH leaves the cursor where it is
+      ab_append_csi_count(ab, len, 'X');
+      ab_append_csi_count(ab, len, 'C');
+    } else {
+      ab_append(ab, &glyphs[x], len);
+    }
+    x = end;
+  }
+}
+
+// Emit the cells of the back grid in row y from x0 to x1 (exclusive), updating
+// the front grid to match.
+void emit_cells(struct abuf *ab, struct emit_state* st, struct screen_grid* front,
+    struct screen_grid* back, int y, int x0, int x1) {
+  emit_move(ab, st, y, x0);
+
+  const uint8_t* glyphs = &back->glyphs[y * back->cols];
+  const uint8_t* attrs = &back->attrs[y * back->cols];
+
+  // Emit runs of cells with the same attribute
+  int x = x0;
+  while(x < x1) {
+    uint8_t attr = attrs[x];
+    int end = x + 1;
+    while((end < x1) && (attrs[end] == attr)) { ++end; }
+
+    ab_reserve(ab, attr_escapes[attr].len + (end - x));
+    if(attr != st->attr) {
+      ab_append_unchecked(ab, attr_escapes[attr].seq, attr_escapes[attr].len);
+      st->attr = attr;
+    }
+    if(st->caps & (TERM_CAP_REP | TERM_CAP_ECH)) {
+      emit_run(ab, st, &glyphs[x], end - x);
+    } else {
+      ab_append_unchecked(ab, &glyphs[x], end - x);
+    }
+    x = end;
+  }
+
+  memcpy(&front->glyphs[y * front->cols + x0], &glyphs[x0], x1 - x0);
+  memcpy(&front->attrs[y * front->cols + x0], &attrs[x0], x1 - x0);
+
+  // After writing the last column the cursor position depends on the
+  // terminal's wrapping behaviour
+  st->x = (x1 < back->cols) ? x1 : -1;
+}
+
+// If row y of the back grid is the front grid with a single cell inserted or
+// deleted part way along, shift the terminal's row with ICH or DCH so that
+// only the inserted cell, if any, needs writing. The front grid is updated to
+// match. Returns non-zero if the row was shifted.
+int emit_row_shift(struct abuf *ab, struct emit_state* st,
+    struct screen_grid* front, struct screen_grid* back, int y) {
+  int cols = back->cols;
+  const uint8_t* bg = &back->glyphs[y * cols];
+  const uint8_t* ba = &back->attrs[y * cols];
+  uint8_t* fg = &front->glyphs[y * cols];
+  uint8_t* fa = &front->attrs[y * cols];
+
+  // Only worth it if the cells which differ span more than a few columns
+  int x = 0;
+  while((x < cols) && (bg[x] == fg[x]) && (ba[x] == fa[x])) { ++x; }
+  int last = cols - 1;
+  while((last > x) && (bg[last] == fg[last]) && (ba[last] == fa[last])) {
+    --last;
+  }
+  if(last - x < 4) { return 0; }
+
+  int n = cols - x - 1;
+  int ins = !memcmp(&bg[x + 1], &fg[x], n) && !memcmp(&ba[x + 1], &fa[x], n);
+  int del = !ins && !memcmp(&bg[x], &fg[x + 1], n) &&
+      !memcmp(&ba[x], &fa[x + 1], n);
+  if(!ins && !del) { return 0; }
+
+  // The blank cell which appears is given the current attribute
+  emit_move(ab, st, y, x);
+  if(st->attr != 0) {
+    ab_append_attr(ab, 0);
+    st->attr = 0;
+  }
+
+  if(ins) {
+    ab_append(ab, U8("\x1b[@"), 3);
+    memmove(&fg[x + 1], &fg[x], n);
+    memmove(&fa[x + 1], &fa[x], n);
+    fg[x] = ' ';
+    fa[x] = 0;
+  } else {
+    ab_append(ab, U8("\x1b[P"), 3);
+    memmove(&fg[x], &fg[x + 1], n);
+    memmove(&fa[x], &fa[x + 1], n);
+    fg[cols - 1] = ' ';
+    fa[cols - 1] = 0;
+  }
+  return 1;
+}
+
+// Emit whatever is needed to make row y of the terminal match the back grid,
+// updating the front grid to match. Spans of changed cells separated by fewer
+// unchanged cells than it would take bytes to move the cursor over them are
+// merged. Returns the number of spans emitted.
+int emit_row_diff(struct abuf *ab, struct emit_state* st,
+    struct screen_grid* front, struct screen_grid* back, int y) {
+  int cols = back->cols;
+  const uint8_t* bg = &back->glyphs[y * cols];
+  const uint8_t* ba = &back->attrs[y * cols];
+  uint8_t* fg = &front->glyphs[y * cols];
+  uint8_t* fa = &front->attrs[y * cols];
+
+  if(!memcmp(bg, fg, cols) && !memcmp(ba, fa, cols)) { return 0; }
+
+  int spans = 0;
+  if((st->caps & TERM_CAP_ICH) && emit_row_shift(ab, st, front, back, y)) {
+    ++spans;
+  }
+
+  // Blank cells at the end of the row can be cleared rather than written
+  int end = cols;
+  while((end > 0) && (bg[end - 1] == ' ') && (ba[end - 1] == 0)) { --end; }
+
+  int x = 0;
+  while(x < end) {
+    if((bg[x] == fg[x]) && (ba[x] == fa[x])) { ++x; continue; }
+
+    // extend the span over unchanged cells only while that is cheaper than
+    // moving the cursor
+    int last_diff = x;
+    int cost = move_cost(y, x);
+    for(int j = x + 1; j < end; ++j) {
+      if((bg[j] != fg[j]) || (ba[j] != fa[j])) {
+        last_diff = j;
+      } else if(j - last_diff > cost) {
+        break;
+      }
+    }
+
+    emit_cells(ab, st, front, back, y, x, last_diff + 1);
+    ++spans;
+    x = last_diff + 1;
+  }
+
+  // Clear any leftovers beyond the end of the row
+  int leftovers = 0;
+  for(int j=end; j<cols; ++j) {
+    if((fg[j] != ' ') || (fa[j] != 0)) { leftovers = 1; break; }
+  }
+  if(leftovers) {
+    emit_move(ab, st, y, end);
+    if(st->attr != 0) {
+      ab_append(ab, U8("\x1b[m"), 3);
+      st->attr = 0;
+    }
+    ab_append(ab, U8("\x1b[K"), 3);
+    memset(&fg[end], ' ', cols - end);
+    memset(&fa[end], 0, cols - end);
+    ++spans;
+  }
+
+  return spans;
+}
+
+//// RENDER THREAD
+
+// Begin a frame. If the terminal supports synchronized output it is asked to
+// show the frame all at once, otherwise the cursor is hidden while drawing.
+void frame_begin(struct abuf *ab, int sync_output) {
+  if(sync_output) {
+    ab_append(ab, U8("\x1b[?2026h"), 8);
+  } else {
+    ab_append(ab, U8("\x1b[?25l"), 6);
+  }
+}
+
+// End a frame begun by frame_begin().
+void frame_end(struct abuf *ab, int sync_output) {
+  if(sync_output) {
+    ab_append(ab, U8("\x1b[?2026l"), 8);
+  } else {
+    ab_append(ab, U8("\x1b[?25h"), 6);
+  }
+}
+
+// Write a frame to the terminal, waiting for it to accept all of it. Time
+// spent waiting is recorded along with the rate at which output drained.
+// Returns the time taken in ns.
+uint64_t render_write(struct renderer* r, const uint8_t* buf, size_t len) {
+  uint64_t start = now_ns(), blocked = 0;
+  size_t left = len;
+  while(left > 0) {
+    ssize_t n = E.term->write(buf, left);
+    if(n >= 0) {
+      buf += n;
+      left -= n;
+      continue;
+    }
+    if(errno == EINTR) { continue; }
+    if((errno != EAGAIN) && (errno != EWOULDBLOCK)) { die("write"); }
+
+    // The terminal is backed up
+    uint64_t t = now_ns();
+    if((-1 == E.term->wait_writable()) && (errno != EINTR)) { die("poll"); }
+    blocked += now_ns() - t;
+  }
+
+  uint64_t end = now_ns();
+  r->bytes_written += len;
+  r->write_time += end - start;
+  r->blocked_time += blocked;
+  if(blocked) {
+    ++r->stalls;
+    r->last_stall = end;
+    uint64_t rate = len * 1000000000ull / (end - start);
+    r->bandwidth = r->bandwidth ? (3 * r->bandwidth + rate) / 4 : rate;
+  }
+  return end - start;
+}
+
+// The row drawn k'th when the terminal is congested. The cursor row comes
+// first, then the status and message bars, then the rest from the top.
+int render_row_order(int k, int rows, int cursor_y) {
+  if(rows < 3) { return k; }
+  int in_window = (cursor_y >= 0) && (cursor_y < rows - 2);
+  if(in_window) {
+    if(k == 0) { return cursor_y; }
+    --k;
+  }
+  if(k < 2) { return rows - 2 + k; }
+  k -= 2;
+  if(in_window && (k >= cursor_y)) { ++k; }
+  return k;
+}
+
+// Draw a snapshot, writing only the cells which differ from what is on the
+// terminal. If the terminal is congested, syntax colours are left out and
+// only as many rows as it can take are drawn. The snapshot's cost is filled
+// in. Returns non-zero if the terminal now shows all of the snapshot.
+int render_frame(struct renderer* r, struct frame_snapshot* snap) {
+  struct abuf* ab = &r->out;
+  struct screen_grid* back = &snap->grid;
+  struct frame_cost* cost = &snap->cost;
+  ab_reset(ab);
+
+  // Draw from a copy without colours if the terminal is congested, keeping
+  // reverse video and search matches. The colours are drawn once it has
+  // caught up since the front grid won't match the snapshot.
+  uint64_t now = now_ns();
+  int congested = r->last_stall && (now - r->last_stall < KILO_CONGESTION_HOLD);
+  ssize_t budget = -1;
+  if(congested) {
+    grid_copy(&r->plain, back);
+    for(int j=0; j<snap->window_rows * back->cols; ++j) {
+      uint8_t attr = r->plain.attrs[j];
+      if((attr & CELL_HL_MASK) != HL_MATCH) {
+        r->plain.attrs[j] = attr & CELL_REVERSE;
+      }
+    }
+    back = &r->plain;
+    ++r->plain_frames;
+
+    budget = r->bandwidth * KILO_CONGESTED_FRAME / 1000000000ull;
+    if(budget < KILO_CONGESTED_MIN_BYTES) { budget = KILO_CONGESTED_MIN_BYTES; }
+  }
+
+  // Begin the frame. This is dropped if nothing is drawn.
+  frame_begin(ab, snap->caps & TERM_CAP_SYNC);
+  ssize_t begin_len = ab->len;
+
+  struct emit_state st = { r->cursor_y, r->cursor_x, -1, snap->caps };
+  int drawn = 0;
+
+  // If we don't know what's on the terminal, start from a blank screen
+  if(!r->front_valid || snap->repaint || (r->front.rows != back->rows) ||
+      (r->front.cols != back->cols)) {
+    ab_append(ab, U8("\x1b[m\x1b[2J"), 7);
+    grid_resize(&r->front, back->rows, back->cols);
+    r->front_valid = 1;
+    st.y = st.x = -1;
+    st.attr = 0;
+    drawn = 1;
+  } else if(snap->scroll_delta && (abs(snap->scroll_delta) < snap->window_rows)) {
+    // Scroll the window region, leaving the status and message bars alone.
+    // Setting and resetting the region homes the cursor.
+    uint8_t buf[32];
+    int len = snprintf((char*)buf, sizeof(buf), "\x1b[m\x1b[1;%dr\x1b[%d%c\x1b[r",
+        snap->window_rows, abs(snap->scroll_delta),
+        (snap->scroll_delta > 0) ? 'S' : 'T');
+    ab_append(ab, buf, len);
+    grid_scroll(&r->front, 0, snap->window_rows, snap->scroll_delta);
+    st.y = st.x = st.attr = 0;
+    drawn = 1;
+  }
+
+  // Emit the differences, in order of importance if there's a budget
+  int complete = !congested;
+  cost->rows = 0;
+  for(int k=0; k<back->rows; ++k) {
+    if((budget >= 0) && (ab->len - begin_len > budget)) {
+      ++r->partial_frames;
+      complete = 0;
+      break;
+    }
+    int y = congested ? render_row_order(k, back->rows, snap->cursor_y) : k;
+    int spans = emit_row_diff(ab, &st, &r->front, back, y);
+    drawn += spans;
+    if(spans) { ++cost->rows; }
+  }
+
+  // Leave the terminal with normal attributes
+  if(drawn && (st.attr != 0)) { ab_append(ab, U8("\x1b[m"), 3); }
+
+  // Cursor -> current position
+  emit_move(ab, &st, snap->cursor_y, snap->cursor_x);
+  r->cursor_y = snap->cursor_y;
+  r->cursor_x = snap->cursor_x;
+
+  if(drawn) { frame_end(ab, snap->caps & TERM_CAP_SYNC); }
+
+  // Output buffer, without the start of the frame if nothing was drawn
+  const uint8_t* out = drawn ? ab->buf : &ab->buf[begin_len];
+  ssize_t out_len = drawn ? ab->len : ab->len - begin_len;
+  cost->bytes = out_len;
+  cost->escapes = 0;
+  for(const uint8_t* p = out; (p = memchr(p, '\x1b', out + out_len - p)); ++p) {
+    ++cost->escapes;
+  }
+  cost->emit = now_ns() - now;
+  cost->write = (out_len > 0) ? render_write(r, out, out_len) : 0;
+
+  return complete;
+}
+
+// Main function of the render thread. Waits for snapshots and draws the latest
+// one. Snapshots published while a frame is being written are coalesced. If a
+// frame couldn't be drawn in full, it is drawn again after KILO_CATCH_UP
+// unless a newer one arrives first.
+void* render_thread(void* arg) {
+  struct renderer* r = arg;
+  int behind = 0;
 
-// a callback taking the current input and last key pressed
-typedef void (*prompt_cb)(char*, int);
+  pthread_mutex_lock(&r->lock);
+  while(1) {
+    if(behind) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      uint64_t t = ts.tv_nsec + KILO_CATCH_UP;
+      ts.tv_sec += t / 1000000000ull;
+      ts.tv_nsec = t % 1000000000ull;
+      while(!r->has_pending && !r->stop &&
+          (ETIMEDOUT != pthread_cond_timedwait(&r->cond, &r->lock, &ts))) {
+      }
+    } else {
+      while(!r->has_pending && !r->stop) { pthread_cond_wait(&r->cond, &r->lock); }
+    }
+    if(!r->has_pending && r->stop) { break; }
+
+    if(r->has_pending) {
+      // Take the pending snapshot, leaving our old one to be reused
+      struct frame_snapshot tmp = r->current;
+      r->current = r->pending;
+      r->pending = tmp;
+      r->has_pending = 0;
+    } else {
+      // Finish drawing the current one, which the editor has already paid
+      // for
+      r->current.scroll_delta = 0;
+      r->current.repaint = 0;
+      r->current.cost.scroll = r->current.cost.draw = 0;
+      r->current.cost.allocs = 0;
+    }
+    r->drawing = 1;
+    pthread_mutex_unlock(&r->lock);
 
-char* editor_prompt(char* prompt, prompt_cb cb);
+    behind = !render_frame(r, &r->current);
 
-//// UTILITY
+    pthread_mutex_lock(&r->lock);
+    r->drawing = 0;
+    r->costs[r->num_costs++ % KILO_COST_FRAMES] = r->current.cost;
+    pthread_cond_broadcast(&r->cond);
+  }
+  pthread_mutex_unlock(&r->lock);
 
-// Print an error message and terminate the program with an error status.
-void die(const char* s) {
-  // Clear screen and re-position cursor.
-  write(STDOUT_FILENO, "\x1b[2J\x1b[H", 7);
+  return NULL;
+}
 
-  perror(s);
-  exit(EXIT_FAILURE);
+// Publish a new frame for the render thread to draw. If the previous one
+// hasn't been taken yet it is replaced, with the scrolling and repainting it
+// asked for and what it cost to build carried over.
+void render_publish(const struct screen_grid* grid, int window_rows,
+    int cursor_y, int cursor_x, int scroll_delta, int repaint,
+    const struct frame_cost* cost) {
+  struct renderer* r = &E.render;
+
+  pthread_mutex_lock(&r->lock);
+  struct frame_snapshot* snap = &r->pending;
+  struct frame_cost total = *cost;
+  if(r->has_pending) {
+    ++E.stats.coalesced_frames;
+    scroll_delta += snap->scroll_delta;
+    repaint |= snap->repaint;
+    total.scroll += snap->cost.scroll;
+    total.draw += snap->cost.draw;
+    total.allocs += snap->cost.allocs;
+  }
+
+  grid_copy(&snap->grid, grid);
+  snap->window_rows = window_rows;
+  snap->cursor_y = cursor_y;
+  snap->cursor_x = cursor_x;
+  snap->scroll_delta = scroll_delta;
+  snap->repaint = repaint;
+  snap->caps = E.term_caps;
+  snap->cost = total;
+  r->has_pending = 1;
+  pthread_cond_broadcast(&r->cond);
+
+  while(r->lockstep && (r->has_pending || r->drawing)) {
+    pthread_cond_wait(&r->cond, &r->lock);
+  }
+  pthread_mutex_unlock(&r->lock);
 }
 
-//// APPEND BUFFER
+// Copy the costs of the most recent frames drawn, oldest first, into costs
+// which has room for KILO_COST_FRAMES. Returns the number copied.
+int render_recent_costs(struct frame_cost* costs) {
+  struct renderer* r = &E.render;
 
-// Append an array of bytes to an append buffer.
-void ab_append(struct abuf *ab, const uint8_t *s, ssize_t len) {
-  if(ab->len + len < ab->len) {
-    die("overflow?");
+  pthread_mutex_lock(&r->lock);
+  int n = (r->num_costs < KILO_COST_FRAMES) ? r->num_costs : KILO_COST_FRAMES;
+  for(int j=0; j<n; ++j) {
+    costs[j] = r->costs[(r->num_costs - n + j) % KILO_COST_FRAMES];
   }
+  pthread_mutex_unlock(&r->lock);
 
-  uint8_t *new = realloc(ab->buf, ab->len + len);
-  if(new == NULL) { die("realloc"); }
+  return n;
+}
 
-  memcpy(&new[ab->len], s, len);
+// Wait for the render thread to draw everything published and stop it. This
+// is registered with atexit() so that nothing is drawn after the terminal is
+// restored.
+void render_stop(void) {
+  struct renderer* r = &E.render;
+  if(!r->running || pthread_equal(pthread_self(), r->thread)) { return; }
 
-  ab->buf = new;
-  ab->len += len;
+  pthread_mutex_lock(&r->lock);
+  r->stop = 1;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+
+  pthread_join(r->thread, NULL);
+  r->running = 0;
 }
 
-void ab_free(struct abuf *ab) {
-  free(ab->buf);
+// Start the render thread.
+void render_start(void) {
+  struct renderer* r = &E.render;
+  memset(r, 0, sizeof(*r));
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  r->cursor_y = r->cursor_x = -1;
+  r->costs = xcalloc(KILO_COST_FRAMES, sizeof(struct frame_cost));
+
+  // Signals are left to the editor thread, whose reads they interrupt
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  if(0 != pthread_create(&r->thread, NULL, render_thread, r)) {
+    die("pthread_create");
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  r->running = 1;
+  atexit(render_stop);
 }
 
 //// TERMINAL HANDLING
@@ -238,14 +1895,14 @@ void restore_terminal(void) {
 // Enable "raw" mode for terminal by disabling both local echo and canonical
 // input mode, stopping SIGINT and SIGSTP from being sent, disabling software
 // flow control and carriage return processing. The read() timeout is also set
-// to be as small as possible (1 decisecond).
+// to be as small as possible (1 decisecond). The original configuration is
+// saved for restore_terminal() to use.
 void enable_raw_mode(void) {
-  struct termios raw;
-
   // Read current attributes
-  if(-1 == tcgetattr(STDIN_FILENO, &raw)) {
+  if(-1 == tcgetattr(STDIN_FILENO, &E.orig_termios)) {
     die("tcgetattr");
   }
+  struct termios raw = E.orig_termios;
 
   // Disable echo, canonical input, signals and implementation-defined input
   // processing.
@@ -269,6 +1926,13 @@ void enable_raw_mode(void) {
   if(-1 == tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw)) {
     die("tcsetattr");
   }
+
+  // Write frames through a separate, non-blocking, open of the terminal so
+  // that we can tell when it is backed up without reads from it becoming
+  // non-blocking too. Failing that, writes block and congestion isn't seen.
+  const char* tty = ttyname(STDOUT_FILENO);
+  E.out_fd = tty ? open(tty, O_WRONLY | O_NOCTTY | O_NONBLOCK) : -1;
+  if(E.out_fd == -1) { E.out_fd = STDOUT_FILENO; }
 }
 
 // Obtain the current terminal size. Returns -1 iff there was an error. One or
@@ -290,18 +1954,197 @@ int get_window_size(int *rows, int *cols) {
   return 0;
 }
 
+void terminal_resized(int sig);
+
+// Start watching for the terminal being resized. Where there are signalfds,
+// SIGWINCH is blocked and read from one instead so that resizes are handled
+// on the event loop. This must be done before any threads are started so
+// that they all have the signal blocked.
+void terminal_watch_resize(void) {
+  E.resize_fd = -1;
+  E.term_resized = 0;
+#ifdef __linux__
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGWINCH);
+  if(0 == sigprocmask(SIG_BLOCK, &mask, NULL)) {
+    E.resize_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(E.resize_fd != -1) { return; }
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+  }
+#endif
+  signal(SIGWINCH, terminal_resized);
+}
+
+// Returns non-zero if the terminal has been resized since last asked. Any
+// number of resizes are taken at once.
+int terminal_take_resize(void) {
+  int resized = E.term_resized;
+  E.term_resized = 0;
+#ifdef __linux__
+  struct signalfd_siginfo info;
+  while((E.resize_fd != -1) &&
+      (read(E.resize_fd, &info, sizeof(info)) == sizeof(info))) {
+    resized = 1;
+  }
+#endif
+  return resized;
+}
+
+// Guess which optional features the terminal supports from $TERM, before any
+// replies to terminal_query() arrive.
+int terminal_caps_from_env(void) {
+  // Terminals which are known to implement at least a VT220's editing
+  // functions
+  static const char* vt220[] = {
+    "xterm", "screen", "tmux", "rxvt", "linux", "foot", "kitty", "alacritty",
+    "wezterm", "vte", "gnome", "konsole", "st-", NULL
+  };
+
+  const char* term = getenv("TERM");
+  if(term == NULL) { return 0; }
+  for(int j=0; vt220[j]; ++j) {
+    if(!strncmp(term, vt220[j], strlen(vt220[j]))) {
+      return TERM_CAP_ECH | TERM_CAP_ICH;
+    }
+  }
+  return 0;
+}
+
+// Ask the terminal which optional features it supports. The replies arrive as
+// input and are handled by terminal_handle_reply().
+void terminal_query(void) {
+  // DECRQM for synchronized output, XTVERSION, secondary and primary device
+  // attributes. Nearly every terminal answers the last of these.
+  const char* query = "\x1b[?2026$p\x1b[>0q\x1b[>c\x1b[c";
+  if(-1 == write(STDOUT_FILENO, query, strlen(query))) { die("write"); }
+}
+
+// Handle a reply to terminal_query(). kind is '?' or '>' for the parameters
+// of a "CSI ?" or "CSI >" sequence, with final as its final byte, or 'P' for
+// the contents of a device control string.
+void terminal_handle_reply(char kind, const char* params, char final) {
+  int mode, value;
+
+  // DECRPM: "?<mode>;<value>$y". Values 1 and 2 mean the mode is set or reset
+  // and so can be changed.
+  if((kind == '?') && (final == 'y') &&
+      (2 == sscanf(params, "%d;%d$", &mode, &value))) {
+    if(mode == 2026) {
+      if((value == 1) || (value == 2)) {
+        E.term_caps |= TERM_CAP_SYNC;
+      } else {
+        E.term_caps &= ~TERM_CAP_SYNC;
+      }
+    }
+  }
+
+  // DA1: "?<class>;<features>...c". Class 62 and above is a VT220 or later.
+  if((kind == '?') && (final == 'c') && (1 == sscanf(params, "%d", &value))) {
+    if(value >= 62) { E.term_caps |= TERM_CAP_ECH | TERM_CAP_ICH; }
+  }
+
+  // DA2: ">Pp;Pv;Pc c". xterm (41) and tmux (84) implement REP.
+  if((kind == '>') && (final == 'c') && (1 == sscanf(params, "%d", &value))) {
+    if((value == 41) || (value == 84)) { E.term_caps |= TERM_CAP_REP; }
+  }
+
+  // XTVERSION: ">|name(version)" or ">|name version". Terminals new enough to
+  // answer this implement the ECMA-48 editing functions. Answering says
+  // nothing about REP, which is only used for names known to implement it: a
+  // terminal which ignored it would be left short of characters.
+  if((kind == 'P') && (params[0] == '>') && (params[1] == '|')) {
+    static const char* rep[] = {
+      "XTerm", "tmux", "foot", "kitty", "WezTerm", "mintty", NULL
+    };
+
+    E.term_caps |= TERM_CAP_ECH | TERM_CAP_ICH;
+    const char* name = &params[2];
+    for(int j=0; rep[j]; ++j) {
+      size_t len = strlen(rep[j]);
+      if(!strncmp(name, rep[j], len) &&
+          ((name[len] == '(') || (name[len] == ' ') || (name[len] == '\0'))) {
+        E.term_caps |= TERM_CAP_REP;
+      }
+    }
+  }
+}
+
+// Read from the controlling terminal. Like a read() timing out, this returns
+// 0 early if the terminal is resized.
+ssize_t tty_read(uint8_t* buf, size_t len) {
+  if(E.resize_fd != -1) {
+    struct pollfd pfd[2] = {
+      { STDIN_FILENO, POLLIN, 0 }, { E.resize_fd, POLLIN, 0 }
+    };
+    int n = poll(pfd, 2, 100);
+    if(n <= 0) { return n; }
+    if(!pfd[0].revents) { return 0; }
+  }
+  return read(STDIN_FILENO, buf, len);
+}
+
+// Wait for input from the controlling terminal. A resize ends the wait
+// without there being any.
+int tty_input_pending(int timeout) {
+  struct pollfd pfd[2] = {
+    { STDIN_FILENO, POLLIN, 0 }, { E.resize_fd, POLLIN, 0 }
+  };
+  int n = poll(pfd, (E.resize_fd != -1) ? 2 : 1, timeout);
+  return (n > 0) ? (pfd[0].revents != 0) : n;
+}
+
+// Write to the controlling terminal.
+ssize_t tty_write(const uint8_t* buf, size_t len) {
+  return write(E.out_fd, buf, len);
+}
+
+// Wait for the controlling terminal to accept more output.
+int tty_wait_writable(void) {
+  struct pollfd pfd = { E.out_fd, POLLOUT, 0 };
+  return poll(&pfd, 1, -1);
+}
+
+// Wait up to timeout milliseconds for input from the keyboard. Returns
+// non-zero if there is some waiting to be read.
+int editor_input_pending(int timeout) {
+  int n;
+  while((-1 == (n = E.term->input_pending(timeout))) && (errno == EINTR)) {
+    // a resize or a finished save shouldn't be mistaken for input
+    if(E.term_resized || E.child_exited) { return 0; }
+  }
+  if(n == -1) { die("poll"); }
+  return n > 0;
+}
+
 // Read the next key from the keyboard.
 int editor_read_key(void) {
   int n_read;
   uint8_t c;
 
   // Keep polling until we read a byte
-  while((n_read = read(STDIN_FILENO, &c, 1)) != 1) {
-    // Under Cygwin, read() sets EAGAIN rather then returning 0 bytes.
-    if((n_read == -1) && (errno != EAGAIN)) { die("read"); }
+  while((n_read = E.term->read(&c, 1)) != 1) {
+    // Under Cygwin, read() sets EAGAIN rather then returning 0 bytes. Signals
+    // may interrupt the read.
+    if((n_read == -1) && (errno != EAGAIN) && (errno != EINTR)) {
+      die("read");
+    }
+    if(E.input_ended) { return INPUT_END_KEY; }
 
     // Handle terminal resize as a "special" key
-    if(E.term_resized) { return TERM_RESIZE_KEY; }
+    if(terminal_take_resize()) {
+      E.resize_pending = 1;
+      return TERM_RESIZE_KEY;
+    }
+
+    // Likewise news from the background loader or a finished background save,
+    // unless we're in a prompt
+    if(!E.prompting && editor_loader_has_news()) { return LOADER_KEY; }
+    if(!E.prompting && E.child_exited) { return CHILD_EXIT_KEY; }
+
+    // The status message timing out needs a frame drawn to clear it. A
+    // prompt's message stays up however long it takes to answer.
+    if(!E.prompting && editor_expire_message()) { return TIMER_KEY; }
   }
 
   // Handle escape sequences
@@ -309,12 +2152,42 @@ int editor_read_key(void) {
     uint8_t seq[3];
 
     // Try to read next two bytes
-    if(read(STDOUT_FILENO, &seq[0], 1) != 1) { return '\x1b'; }
-    if(read(STDOUT_FILENO, &seq[1], 1) != 1) { return '\x1b'; }
-
-    if(seq[0] == '[') {
+    if(E.term->read(&seq[0], 1) != 1) { return '\x1b'; }
+    if(E.term->read(&seq[1], 1) != 1) { return '\x1b'; }
+
+    if((seq[0] == '[') && ((seq[1] == '?') || (seq[1] == '>'))) {
+      // A reply from the terminal. Read up to and including the final byte.
+      char reply[32];
+      int len = 0;
+      while(len < (int)sizeof(reply) - 1) {
+        if(E.term->read((uint8_t*)&reply[len], 1) != 1) { return '\x1b'; }
+        if((reply[len] >= 0x40) && (reply[len] <= 0x7e)) { break; }
+        ++len;
+      }
+      char final = reply[len];
+      reply[len] = '\0';
+      terminal_handle_reply(seq[1], reply, final);
+      return TERM_REPLY_KEY;
+    } else if((seq[0] == 'P') && (seq[1] == '>')) {
+      // A device control string reply, up to the string terminator "ESC \".
+      // Anything which doesn't fit is dropped.
+      char reply[64] = ">";
+      int len = 1;
+      uint8_t b;
+      while(1) {
+        if(E.term->read(&b, 1) != 1) { return '\x1b'; }
+        if(b == '\x1b') {
+          if(E.term->read(&b, 1) != 1) { return '\x1b'; }
+          break;
+        }
+        if(len < (int)sizeof(reply) - 1) { reply[len++] = b; }
+      }
+      reply[len] = '\0';
+      terminal_handle_reply('P', reply, '\0');
+      return TERM_REPLY_KEY;
+    } else if(seq[0] == '[') {
       if((seq[1] >= '0') && (seq[1] <= '9')) {
-        if(read(STDOUT_FILENO, &seq[2], 1) != 1) { return '\x1b'; }
+        if(E.term->read(&seq[2], 1) != 1) { return '\x1b'; }
         if(seq[2] == '~') {
           switch(seq[1]) {
             case '1': return HOME_KEY;
@@ -353,6 +2226,256 @@ int editor_read_key(void) {
   return c;
 }
 
+//// HEADLESS TERMINAL
+
+// Set up the headless terminal.
+void vt_init(int rows, int cols) {
+  memset(&VT, 0, sizeof(VT));
+  grid_resize(&VT.screen, rows, cols);
+  VT.bottom = rows;
+  VT.last = ' ';
+}
+
+// Move the cursor down a line, scrolling the scrolling region if it's at the
+// bottom.
+void vt_line_feed(void) {
+  if(VT.y == VT.bottom - 1) {
+    grid_scroll(&VT.screen, VT.top, VT.bottom, 1);
+  } else if(VT.y < VT.screen.rows - 1) {
+    ++VT.y;
+  }
+}
+
+// Write a character at the cursor.
+void vt_put(uint8_t c) {
+  if(VT.wrap_pending) {
+    VT.x = 0;
+    vt_line_feed();
+    VT.wrap_pending = 0;
+  }
+  VT.screen.glyphs[VT.y * VT.screen.cols + VT.x] = c;
+  VT.last = c;
+  if(VT.x == VT.screen.cols - 1) {
+    VT.wrap_pending = 1;
+  } else {
+    ++VT.x;
+  }
+}
+
+// Clamp a value to lie within [lo, hi].
+int vt_clamp(int v, int lo, int hi) {
+  return (v < lo) ? lo : ((v > hi) ? hi : v);
+}
+
+// Carry out a control sequence with the given final byte.
+void vt_csi(char final) {
+  struct screen_grid* g = &VT.screen;
+  uint8_t* row = &g->glyphs[VT.y * g->cols];
+  int n = (VT.num_params > 0) ? VT.params[0] : 0;
+  int n1 = n ? n : 1; // parameter defaulting to 1
+  int cols_left = g->cols - VT.x;
+
+  // Modes, queries and the like don't change the screen
+  if(VT.prefix || VT.intermediate) { return; }
+
+  switch(final) {
+    case 'H':
+    case 'f':
+      VT.y = vt_clamp(n1 - 1, 0, g->rows - 1);
+      VT.x = vt_clamp(((VT.num_params > 1) && VT.params[1]) ? VT.params[1] - 1 : 0,
+          0, g->cols - 1);
+      break;
+    case 'A': VT.y = vt_clamp(VT.y - n1, 0, g->rows - 1); break;
+    case 'B': VT.y = vt_clamp(VT.y + n1, 0, g->rows - 1); break;
+    case 'C': VT.x = vt_clamp(VT.x + n1, 0, g->cols - 1); break;
+    case 'D': VT.x = vt_clamp(VT.x - n1, 0, g->cols - 1); break;
+    case 'G': VT.x = vt_clamp(n1 - 1, 0, g->cols - 1); break;
+    case 'd': VT.y = vt_clamp(n1 - 1, 0, g->rows - 1); break;
+    case 'J':
+      if(n == 2) {
+        memset(g->glyphs, ' ', g->rows * g->cols);
+      } else if(n == 0) {
+        memset(&row[VT.x], ' ', cols_left);
+        memset(row + g->cols, ' ', (g->rows - VT.y - 1) * g->cols);
+      } else if(n == 1) {
+        memset(g->glyphs, ' ', VT.y * g->cols + VT.x + 1);
+      }
+      break;
+    case 'K':
+      if(n == 0) { memset(&row[VT.x], ' ', cols_left); }
+      if(n == 1) { memset(row, ' ', VT.x + 1); }
+      if(n == 2) { memset(row, ' ', g->cols); }
+      break;
+    case 'X':
+      memset(&row[VT.x], ' ', (n1 < cols_left) ? n1 : cols_left);
+      break;
+    case '@':
+      if(n1 > cols_left) { n1 = cols_left; }
+      memmove(&row[VT.x + n1], &row[VT.x], cols_left - n1);
+      memset(&row[VT.x], ' ', n1);
+      break;
+    case 'P':
+      if(n1 > cols_left) { n1 = cols_left; }
+      memmove(&row[VT.x], &row[VT.x + n1], cols_left - n1);
+      memset(&row[g->cols - n1], ' ', n1);
+      break;
+    case 'b':
+      for(int j=0; j<n1; ++j) { vt_put(VT.last); }
+      return;
+    case 'r':
+      VT.top = n1 - 1;
+      VT.bottom = ((VT.num_params > 1) && VT.params[1]) ? VT.params[1] : g->rows;
+      VT.top = vt_clamp(VT.top, 0, g->rows - 1);
+      VT.bottom = vt_clamp(VT.bottom, VT.top + 1, g->rows);
+      VT.y = VT.x = 0;
+      break;
+    case 'S': grid_scroll(g, VT.top, VT.bottom, n1); break;
+    case 'T': grid_scroll(g, VT.top, VT.bottom, -n1); break;
+    default: break; // SGR and anything else we don't emulate
+  }
+  VT.wrap_pending = 0;
+}
+
+// Feed bytes written to the headless terminal through its parser.
+void vt_feed(const uint8_t* buf, size_t len) {
+  for(size_t j=0; j<len; ++j) {
+    uint8_t c = buf[j];
+    switch(VT.state) {
+      case VT_GROUND:
+        if(c == '\x1b') {
+          VT.state = VT_ESCAPE;
+        } else if(c == '\r') {
+          VT.x = 0;
+          VT.wrap_pending = 0;
+        } else if(c == '\n') {
+          vt_line_feed();
+        } else if(c == '\b') {
+          if(VT.x > 0) { --VT.x; }
+          VT.wrap_pending = 0;
+        } else if(c == '\t') {
+          VT.x = vt_clamp((VT.x / KILO_TAB_STOP + 1) * KILO_TAB_STOP, 0,
+              VT.screen.cols - 1);
+        } else if(c >= ' ') {
+          vt_put(c);
+        }
+        break;
+
+      case VT_ESCAPE:
+        if(c == '[') {
+          VT.state = VT_CSI;
+          VT.num_params = 0;
+          VT.prefix = VT.intermediate = 0;
+        } else if((c == 'P') || (c == ']')) {
+          VT.state = VT_STRING;
+        } else {
+          VT.state = VT_GROUND;
+        }
+        break;
+
+      case VT_CSI:
+        if(isdigit(c)) {
+          if(VT.num_params == 0) { VT.params[VT.num_params++] = 0; }
+          int* p = &VT.params[VT.num_params - 1];
+          if(*p < 100000) { *p = *p * 10 + (c - '0'); }
+        } else if(c == ';') {
+          if(VT.num_params == 0) { VT.params[VT.num_params++] = 0; }
+          if(VT.num_params < (int)(sizeof(VT.params) / sizeof(VT.params[0]))) {
+            VT.params[VT.num_params++] = 0;
+          }
+        } else if((c >= '<') && (c <= '?')) {
+          VT.prefix = c;
+        } else if((c >= ' ') && (c <= '/')) {
+          VT.intermediate = c;
+        } else {
+          if((c >= '@') && (c <= '~')) { vt_csi(c); }
+          VT.state = VT_GROUND;
+        }
+        break;
+
+      case VT_STRING:
+        if(c == '\x1b') { VT.state = VT_STRING_ESC; }
+        if(c == '\a') { VT.state = VT_GROUND; }
+        break;
+
+      case VT_STRING_ESC:
+        VT.state = (c == '\\') ? VT_GROUND : VT_STRING;
+        break;
+    }
+  }
+}
+
+// Headless terminals don't need any set up.
+void vt_open(void) {
+}
+
+// Print the headless terminal's screen, the cursor position and the bytes
+// taken by each frame to stdout.
+void vt_close(void) {
+  struct screen_grid* g = &VT.screen;
+  for(int y=0; y<g->rows; ++y) {
+    int len = g->cols;
+    while((len > 0) && (g->glyphs[y * g->cols + len - 1] == ' ')) { --len; }
+    printf("%.*s\n", len, &g->glyphs[y * g->cols]);
+  }
+  printf("cursor %d %d\n", VT.y + 1, VT.x + 1);
+  for(int j=0; j<VT.num_frames; ++j) {
+    printf("frame %d %zd\n", j + 1, VT.frames[j]);
+  }
+}
+
+// The headless terminal is whatever size it was made.
+int vt_get_size(int* rows, int* cols) {
+  if(rows != NULL) { *rows = VT.screen.rows; }
+  if(cols != NULL) { *cols = VT.screen.cols; }
+  return 0;
+}
+
+// Keys for the headless terminal come from stdin. The end of input is noted so
+// that the input loop can finish.
+ssize_t vt_read(uint8_t* buf, size_t len) {
+  ssize_t n = read(STDIN_FILENO, buf, len);
+  if(n == 0) { E.input_ended = 1; }
+  return n;
+}
+
+// Input is only waited for when a key is read, so that a frame is drawn after
+// every key.
+int vt_input_pending(int timeout) {
+  (void)timeout;
+  return 0;
+}
+
+// A frame written to the headless terminal.
+ssize_t vt_write(const uint8_t* buf, size_t len) {
+  if(VT.num_frames == VT.cap_frames) {
+    VT.cap_frames = VT.cap_frames ? 2 * VT.cap_frames : 64;
+    VT.frames = xrealloc(VT.frames, VT.cap_frames * sizeof(ssize_t));
+  }
+  VT.frames[VT.num_frames++] = len;
+  vt_feed(buf, len);
+  return len;
+}
+
+// The headless terminal never backs up.
+int vt_wait_writable(void) {
+  return 0;
+}
+
+// The headless terminal understands all the optional sequences.
+void vt_query(void) {
+  E.term_caps = TERM_CAP_ECH | TERM_CAP_ICH | TERM_CAP_REP;
+}
+
+struct term_backend tty_backend = {
+  enable_raw_mode, restore_terminal, get_window_size, tty_read,
+  tty_input_pending, tty_write, tty_wait_writable, terminal_query,
+};
+
+struct term_backend vt_backend = {
+  vt_open, vt_close, vt_get_size, vt_read, vt_input_pending, vt_write,
+  vt_wait_writable, vt_query,
+};
+
 //// SYNTAX HIGHLIGHTING
 
 // returns non-zero if c is a separator character
@@ -360,45 +2483,49 @@ int is_separator(int c) {
   return isspace(c) || (c == '\0') || (strchr(",.()+-/*=~%<>[];", c) != NULL);
 }
 
-// Update syntax highlighting for a single row
-void editor_update_syntax(erow* row) {
-  // re-allocate hl buffer
-  row->hl = realloc(row->hl, row->r_size);
-  memset(row->hl, HL_NORMAL, row->r_size);
-
-  // if there's no syntax highlighting info, that's all
-  if(E.syntax == NULL) { return; }
-
-  // was previous character a separator?
-  int prev_sep = 1;
+// Highlight render[from, to) of a row using the given syntax rules, resuming
+// from the lexer state st which is left as the state at to. A token may run
+// past to, in which case st->skip says how far. This touches no editor state.
+void editor_highlight_span(struct editor_syntax* syntax, erow* row,
+    int from, int to, struct hl_state* st) {
+  if(syntax == NULL) { return; }
 
-  // are we within a string? if so, set this to the terminating char.
-  int in_string = 0;
+  if(st->line_comment) {
+    if(from + st->skip < to) {
+      memset(&row->hl[from + st->skip], HL_COMMENT, to - from - st->skip);
+    }
+    st->skip = 0;
+    st->prev_hl = HL_COMMENT;
+    return;
+  }
 
-  // Are we within a multiline comment from the previous row?
-  int in_comment = (row->idx > 0) && (E.row[row->idx-1].hl_open_comment);
+  int prev_sep = st->prev_sep;
+  int in_string = st->in_string;
+  int in_comment = st->in_comment;
 
   // what (if any) prefix denotes single and multi line comments
-  char* scs = E.syntax->singleline_comment_start;
-  char* mcs = E.syntax->multiline_comment_start;
-  char* mce = E.syntax->multiline_comment_end;
+  char* scs = syntax->singleline_comment_start;
+  char* mcs = syntax->multiline_comment_start;
+  char* mce = syntax->multiline_comment_end;
   
   int scs_len = scs ? strlen(scs) : 0;
   int mcs_len = mcs ? strlen(mcs) : 0;
   int mce_len = mce ? strlen(mce) : 0;
 
   // keywords
-  char **keywords = E.syntax->keywords;
+  char **keywords = syntax->keywords;
 
-  int i=0;
-  while(i < row->r_size) {
+  int i = from + st->skip;
+  while(i < to) {
     char c = row->render[i];
     uint8_t prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
 
     if(scs_len && !in_string && !in_comment) {
       if(!strncmp((char*)&row->render[i], scs, scs_len)) {
         // rest of line is a comment
-        memset(&row->hl[i], HL_COMMENT, row->r_size - i);
+        memset(&row->hl[i], HL_COMMENT, to - i);
+        st->line_comment = 1;
+        i = to;
         break;
       }
     }
@@ -424,7 +2551,7 @@ void editor_update_syntax(erow* row) {
       }
     }
 
-    if(E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+    if(syntax->flags & HL_HIGHLIGHT_STRINGS) {
       if(in_string) {
         row->hl[i] = HL_STRING;
         
@@ -449,7 +2576,7 @@ void editor_update_syntax(erow* row) {
       }
     }
 
-    if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+    if(syntax->flags & HL_HIGHLIGHT_NUMBERS) {
       if((isdigit(c) && (prev_sep || (prev_hl == HL_NUMBER))) ||
          ((c == '.') && (prev_hl == HL_NUMBER))) {
         row->hl[i] = HL_NUMBER;
@@ -482,37 +2609,65 @@ void editor_update_syntax(erow* row) {
     ++i;
   }
 
+  st->prev_sep = prev_sep;
+  st->in_string = in_string;
+  st->in_comment = in_comment;
+  st->skip = i - to;
+  st->prev_hl = (to > 0) ? row->hl[to - 1] : HL_NORMAL;
+}
+
+// Highlight a single row using the given syntax rules. in_comment is non-zero
+// if the row starts within a multiline comment. This touches no editor state and
+// so may be used on rows which are not (yet) part of the editor.
+void editor_highlight_row(struct editor_syntax* syntax, erow* row,
+    int in_comment) {
+  // re-allocate hl buffer
+  row->hl = xrealloc(row->hl, row->r_size);
+  memset(row->hl, HL_NORMAL, row->r_size);
+
+  struct hl_state st = { in_comment, 0, 1, 0, 0, HL_NORMAL };
+  if(row->chunks == NULL) {
+    editor_highlight_span(syntax, row, 0, row->r_size, &st);
+  } else {
+    // remember where each chunk starts so that it can be re-highlighted alone
+    for(int k=0; k<row->num_chunks; ++k) {
+      struct row_chunk* c = &row->chunks[k];
+      c->hl_start = st;
+      editor_highlight_span(syntax, row, c->r_start, c->r_start + c->r_len,
+          &st);
+    }
+  }
+
+  row->hl_open_comment = (syntax != NULL) && st.in_comment;
+}
+
+// Update syntax highlighting for a single row
+void editor_update_syntax(erow* row) {
+  // Are we within a multiline comment from the previous row?
+  int in_comment = (row->idx > 0) && (E.row[row->idx-1].hl_open_comment);
+
   // look to see if the multiline comment flag changed
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
+  int was_open = row->hl_open_comment;
+  editor_highlight_row(E.syntax, row, in_comment);
+  editor_syntax_changed(row, was_open);
+}
+
+// Note that a row's highlighting changed. was_open is whether it ended within
+// a multiline comment beforehand.
+void editor_syntax_changed(erow* row, int was_open) {
+  editor_damage_row(row->idx);
+  int changed = (row->hl_open_comment != was_open);
   if(changed && (row->idx + 1 < E.num_rows)) {
     // update syntax for row underneath us if necessary
     editor_update_syntax(&E.row[row->idx+1]);
   }
 }
 
-// Convert a syntax highlight token to the corresponding ANSI color code
-int editor_syntax_to_colour(int hl) {
-  switch(hl) {
-    case HL_MLCOMMENT:
-    case HL_COMMENT:
-      return 36; // cyan
-    case HL_KEYWORD1: return 33; // yellow
-    case HL_KEYWORD2: return 32; // green
-    case HL_STRING: return 35; // magenta
-    case HL_NUMBER: return 31; // red
-    case HL_MATCH: return 34; // blue
-    default: return 37; // white
-  }
-}
-
-// Match current filename to a set of syntax highlighting rules
-void editor_select_syntax_highlight(void) {
-  // reset any existing association
-  E.syntax = NULL;
-
+// Find the syntax highlighting rules for a filename. Returns NULL if there are
+// none.
+struct editor_syntax* editor_syntax_for_filename(const char* filename) {
   // if there's no filename, that's it
-  if(E.filename == NULL) { return; }
+  if(filename == NULL) { return NULL; }
 
   // loop over each entry
   for(unsigned int j=0; j<HLDB_ENTRIES; ++j) {
@@ -520,42 +2675,242 @@ void editor_select_syntax_highlight(void) {
 
     // loop over filematch entries
     for(int i=0; s->filematch[i] != NULL; ++i) {
-      char* p = strstr(E.filename, s->filematch[i]);
+      const char* p = strstr(filename, s->filematch[i]);
       if(p != NULL) {
         int patlen = strlen(s->filematch[i]);
         if((s->filematch[i][0] != '.') || (p[patlen] == '\0')) {
           // it's a match!
-          E.syntax = s;
-
-          // re-highlight file
-          for(int file_row=0; file_row < E.num_rows; ++file_row) {
-            editor_update_syntax(&E.row[file_row]);
-          }
-          return;
+          return s;
         }
       }
     }
   }
+
+  return NULL;
+}
+
+// Match current filename to a set of syntax highlighting rules
+void editor_select_syntax_highlight(void) {
+  // reset any existing association
+  E.syntax = editor_syntax_for_filename(E.filename);
+  if(E.syntax == NULL) { return; }
+
+  // re-highlight file
+  editor_damage_all();
+  int in_comment = 0;
+  for(int file_row=0; file_row < E.num_rows; ++file_row) {
+    editor_highlight_row(E.syntax, &E.row[file_row], in_comment);
+    in_comment = E.row[file_row].hl_open_comment;
+  }
+}
+
+//// SOFT WRAP
+
+// Number of screen lines a row takes up when wrapped at width columns. There
+// is always room for the cursor after the last character.
+int wrap_row_lines(erow* row, int width) {
+  return row->r_size / width + 1;
+}
+
+// Make sure the wrap index matches the rows and the window width. Rows keep
+// their line counts unless the width has changed.
+//
+// A change of width, from a resize or the gutter growing, rewraps every row in
+// the file and not just those on screen: placing the window needs the line
+// counts of all the rows above it. Each row costs a division, which is around
+// 10ms for a million rows.
+void wrap_ensure(void) {
+  struct wrap_index* w = &E.wrap;
+  int width = E.text_cols;
+  if(w->valid && (w->width == width) && (w->n == E.num_rows)) { return; }
+
+  int rewrap = (w->width != width);
+  if(E.num_rows + 1 > w->cap) {
+    w->cap = E.num_rows + 1;
+    w->tree = xrealloc(w->tree, sizeof(int) * w->cap);
+  }
+  w->n = E.num_rows;
+  w->width = width;
+
+  // Build the tree in linear time by pushing each partial sum up to its parent
+  for(int i=1; i<=w->n; ++i) {
+    erow* row = &E.row[i - 1];
+    if(rewrap || (row->wrap_lines == 0)) {
+      row->wrap_lines = wrap_row_lines(row, width);
+    }
+    w->tree[i] = row->wrap_lines;
+  }
+  for(int i=1; i<=w->n; ++i) {
+    int parent = i + (i & -i);
+    if(parent <= w->n) { w->tree[parent] += w->tree[i]; }
+  }
+
+  w->valid = 1;
+}
+
+// Note that rows have been added or removed.
+void wrap_invalidate(void) {
+  E.wrap.valid = 0;
+}
+
+// Update the wrap index after a row's contents have changed.
+void wrap_update_row(erow* row) {
+  struct wrap_index* w = &E.wrap;
+  int in_editor = (row->idx >= 0) && (row->idx < E.num_rows) &&
+    (&E.row[row->idx] == row);
+
+  if(!E.wrap_mode || !in_editor || !w->valid || (w->width != E.text_cols) ||
+      (row->wrap_lines == 0)) {
+    // it'll be counted when the index is next rebuilt, by which time which
+    // lines have moved is no longer known
+    row->wrap_lines = 0;
+    w->valid = w->valid && !in_editor;
+    if(E.wrap_mode && in_editor) { E.full_redraw = 1; }
+    return;
+  }
+
+  int lines = wrap_row_lines(row, w->width);
+  int delta = lines - row->wrap_lines;
+  row->wrap_lines = lines;
+  for(int i=row->idx + 1; delta && (i<=w->n); i += i & -i) {
+    w->tree[i] += delta;
+  }
+
+  // the rows below have moved up or down the screen
+  if(delta) { editor_damage_rows_from(row->idx); }
+}
+
+// Number of screen lines taken up by the rows before row at.
+int wrap_prefix(int at) {
+  int sum = 0;
+  for(int i=at; i>0; i -= i & -i) { sum += E.wrap.tree[i]; }
+  return sum;
+}
+
+// Find the screen line of the last frame, when soft wrapping, at which a row
+// started. Returns 0 if the wrap index no longer says.
+int wrap_last_line(int at, int* y) {
+  struct wrap_index* w = &E.wrap;
+  if(!w->valid || (w->width != E.text_cols) || (at > w->n)) { return 0; }
+  *y = wrap_prefix(at) - E.last_wrap_top;
+  return 1;
+}
+
+// Find the row on a screen line counting from the start of the file. The line
+// within the row is returned in sub. Lines beyond the last row are returned as
+// lines of row E.num_rows.
+int wrap_locate(int line, int* sub) {
+  struct wrap_index* w = &E.wrap;
+  int pos = 0;
+
+  int step = 1;
+  while(step * 2 <= w->n) { step *= 2; }
+  for(; step > 0; step /= 2) {
+    if((pos + step <= w->n) && (w->tree[pos + step] <= line)) {
+      pos += step;
+      line -= w->tree[pos];
+    }
+  }
+
+  *sub = line;
+  return pos;
+}
+
+// Screen lines taken up by a row, counting the row just beyond the end of the
+// file as one line.
+int wrap_lines_of(int at) {
+  return (at < E.num_rows) ? E.row[at].wrap_lines : 1;
+}
+
+// Turn soft wrapping on or off.
+void editor_toggle_wrap(void) {
+  E.wrap_mode = !E.wrap_mode;
+  E.wrap_sub = 0;
+  wrap_invalidate();
+  editor_damage_all();
+  editor_set_status_message("Soft wrap %s", E.wrap_mode ? "on" : "off");
 }
 
 //// Row-wise operations
 
-// Compute the rendered x-position for a given cursor offset in a row
+// Advance a rendered x-position over the bytes of a row from cx to end.
+int editor_row_advance_rx(erow* row, int cx, int end, int rx) {
+  for(int j=cx; j < end; ++j) {
+    if(row->chars[j] == '\t') {
+      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+    }
+    ++rx;
+  }
+  return rx;
+}
+
+// Compute column marks for a long row until there are at least n of them or
+// the row runs out. Returns the number of valid marks.
+int editor_row_extend_col_marks(erow* row, int n) {
+  int max_marks = row->size / KILO_COL_MARK_STEP + 1;
+  if(n > max_marks) { n = max_marks; }
+
+  if(n > row->cap_col_marks) {
+    row->cap_col_marks = max_marks;
+    row->col_marks = xrealloc(row->col_marks, sizeof(int) * max_marks);
+  }
+
+  if((n > 0) && (row->num_col_marks == 0)) {
+    row->col_marks[0] = 0;
+    row->num_col_marks = 1;
+  }
+  for(int k=row->num_col_marks; k<n; ++k) {
+    row->col_marks[k] = editor_row_advance_rx(row, (k - 1) * KILO_COL_MARK_STEP,
+        k * KILO_COL_MARK_STEP, row->col_marks[k - 1]);
+  }
+  if(n > row->num_col_marks) { row->num_col_marks = n; }
+
+  return row->num_col_marks;
+}
+
+// Forget column marks for a row which are affected by a change at byte at.
+void editor_row_invalidate_col_marks(erow* row, int at) {
+  int keep = at / KILO_COL_MARK_STEP + 1;
+  if(row->num_col_marks > keep) { row->num_col_marks = keep; }
+}
+
+// Compute the rendered x-position for a given cursor offset in a row. Long
+// rows start from the nearest column mark.
 int editor_row_cx_to_rx(erow* row, int cx) {
-  int rx = 0;
-  for(int j=0; j < cx; ++j) {
-    if(row->chars[j] == '\t') {
-      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-    }
-    ++rx;
+  if(row->size < KILO_COL_MARK_MIN) {
+    return editor_row_advance_rx(row, 0, cx, 0);
   }
-  return rx;
+
+  int k = cx / KILO_COL_MARK_STEP;
+  editor_row_extend_col_marks(row, k + 1);
+  return editor_row_advance_rx(row, k * KILO_COL_MARK_STEP, cx,
+      row->col_marks[k]);
 }
 
-// Compute the cursor offset for the given rendered x-position
+// Compute the cursor offset for the given rendered x-position. Long rows
+// start from the last column mark before it.
 int editor_row_rx_to_cx(erow* row, int rx_target) {
   int rx = 0, cx = 0;
-  for(cx=0; cx < row->size; ++cx) {
+
+  if(row->size >= KILO_COL_MARK_MIN) {
+    // make sure the marks extend beyond the target, or to the end of the row
+    int n = row->num_col_marks;
+    while(((n == 0) || (row->col_marks[n - 1] <= rx_target)) &&
+        (n < row->size / KILO_COL_MARK_STEP + 1)) {
+      n = editor_row_extend_col_marks(row, n ? 2 * n : 16);
+    }
+
+    // find the last mark at or before the target
+    int lo = 0, hi = n - 1;
+    while(lo < hi) {
+      int mid = (lo + hi + 1) / 2;
+      if(row->col_marks[mid] <= rx_target) { lo = mid; } else { hi = mid - 1; }
+    }
+    cx = lo * KILO_COL_MARK_STEP;
+    rx = row->col_marks[lo];
+  }
+
+  for(; cx < row->size; ++cx) {
     if(row->chars[cx] == '\t') {
       rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
     }
@@ -566,30 +2921,289 @@ int editor_row_rx_to_cx(erow* row, int rx_target) {
   return cx;
 }
 
-// Update a row structure after modification by re-computing it's rendered form.
-void editor_update_row(erow* row) {
-  int tabs = 0;
-  for(int j=0; j<row->size; ++j) {
-    if(row->chars[j] == '\t') { ++tabs; }
+// Render len bytes of a row into render, which starts phase columns past a
+// tab stop. Runs of printable bytes are copied whole. If render is NULL, the
+// length is only measured. Returns the rendered length, adding the number of
+// tabs and of other bytes which aren't printable to *tabs and *controls.
+int editor_render_bytes(uint8_t* render, const uint8_t* chars, int len,
+    int phase, int* tabs, int* controls) {
+  int idx = 0;
+  for(int j=0; j<len; ++j) {
+    int run = printable_span(&chars[j], len - j);
+    if(render) { memcpy(&render[idx], &chars[j], run); }
+    idx += run;
+    j += run;
+    if(j == len) { break; }
+
+    if(chars[j] == '\t') {
+      int n = KILO_TAB_STOP - (phase + idx) % KILO_TAB_STOP;
+      if(render) { memset(&render[idx], ' ', n); }
+      idx += n;
+      ++*tabs;
+    } else {
+      if(render) { render[idx] = chars[j]; }
+      ++idx;
+      ++*controls;
+    }
   }
+  return idx;
+}
+
+// Re-compute the rendered form of a row from its characters. Long rows are
+// also split into chunks. Like editor_highlight_row(), this touches no editor
+// state.
+void editor_render_row(erow* row) {
+  int tabs = count_byte(row->chars, row->size, '\t');
 
   free(row->render);
-  row->render = malloc(row->size + tabs*(KILO_TAB_STOP-1) + 1);
+  row->render = xmalloc(row->size + tabs*(KILO_TAB_STOP-1) + 1);
+
+  free(row->chunks);
+  row->chunks = NULL;
+  row->num_chunks = 0;
+  if(row->size >= KILO_CHUNK_MIN) {
+    int n = (row->size + KILO_CHUNK_SIZE - 1) / KILO_CHUNK_SIZE;
+    row->chunks = xmalloc(n * sizeof(struct row_chunk));
+    memset(row->chunks, 0, n * sizeof(struct row_chunk));
+    row->num_chunks = n;
+  }
 
-  int idx = 0;
-  for(int j=0; j<row->size; ++j) {
-    if(row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while(idx % KILO_TAB_STOP != 0) { row->render[idx++] = ' '; }
+  int controls = 0;
+  if(row->chunks) {
+    int idx = 0;
+    for(int k=0; k<row->num_chunks; ++k) {
+      struct row_chunk* c = &row->chunks[k];
+      int j = k * KILO_CHUNK_SIZE;
+      c->start = j;
+      c->len = (row->size - j < KILO_CHUNK_SIZE) ? row->size - j : KILO_CHUNK_SIZE;
+      c->r_start = idx;
+      c->phase = idx % KILO_TAB_STOP;
+      c->r_len = editor_render_bytes(&row->render[idx], &row->chars[j], c->len,
+          c->phase, &c->tabs, &controls);
+      idx += c->r_len;
+    }
+    row->r_size = idx;
+  } else {
+    tabs = 0;
+    row->r_size = editor_render_bytes(row->render, row->chars, row->size, 0,
+        &tabs, &controls);
+  }
+  row->render[row->r_size] = '\0';
+  row->has_controls = (controls > 0);
+}
+
+// Re-render chunk k of a long row in place, moving the rendered bytes of the
+// chunks after it up or down as needed. The chunk is left marked dirty so that
+// it gets highlighted again.
+void editor_render_chunk(erow* row, int k) {
+  struct row_chunk* c = &row->chunks[k];
+  const uint8_t* chars = &row->chars[c->start];
+
+  int phase = c->r_start % KILO_TAB_STOP;
+  int tabs = 0, controls = 0;
+  int r_len = editor_render_bytes(NULL, chars, c->len, phase, &tabs, &controls);
+
+  // make room for, or close the gap left by, the new rendered form
+  int delta = r_len - c->r_len;
+  int tail = c->r_start + c->r_len;
+  if(delta > 0) {
+    row->render = xrealloc(row->render, row->r_size + delta + 1);
+    row->hl = xrealloc(row->hl, row->r_size + delta);
+  }
+  if(delta != 0) {
+    memmove(&row->render[tail + delta], &row->render[tail],
+        row->r_size - tail + 1);
+    memmove(&row->hl[tail + delta], &row->hl[tail], row->r_size - tail);
+    row->r_size += delta;
+    for(int j=k+1; j<row->num_chunks; ++j) { row->chunks[j].r_start += delta; }
+  }
+
+  tabs = controls = 0;
+  editor_render_bytes(&row->render[c->r_start], chars, c->len, phase, &tabs,
+      &controls);
+
+  // the flag isn't cleared here as other chunks may have control characters
+  if(controls) { row->has_controls = 1; }
+  c->r_len = r_len;
+  c->tabs = tabs;
+  c->phase = phase;
+  c->dirty = 1;
+}
+
+// Split chunk k of a long row in half. Both halves are left marked dirty.
+void editor_split_chunk(erow* row, int k) {
+  row->chunks = xrealloc(row->chunks,
+      (row->num_chunks + 1) * sizeof(struct row_chunk));
+  memmove(&row->chunks[k+1], &row->chunks[k],
+      (row->num_chunks - k) * sizeof(struct row_chunk));
+  ++row->num_chunks;
+
+  struct row_chunk* a = &row->chunks[k];
+  struct row_chunk* b = &row->chunks[k+1];
+  int len = a->len / 2;
+
+  // find where the second half starts within the rendered form
+  int tabs = 0, r_len = 0;
+  for(int j=0; j<len; ++j) {
+    if(row->chars[a->start + j] == '\t') {
+      r_len += KILO_TAB_STOP - (a->phase + r_len) % KILO_TAB_STOP;
+      ++tabs;
     } else {
-      row->render[idx++] = row->chars[j];
+      ++r_len;
+    }
+  }
+
+  b->start = a->start + len;
+  b->len = a->len - len;
+  b->r_start = a->r_start + r_len;
+  b->r_len = a->r_len - r_len;
+  b->tabs = a->tabs - tabs;
+  b->phase = b->r_start % KILO_TAB_STOP;
+  a->len = len;
+  a->r_len = r_len;
+  a->tabs = tabs;
+  a->dirty = b->dirty = 1;
+}
+
+// Bring the chunks of a long row up to date after bytes were inserted or
+// removed at offset from. Only the chunks which were touched are rendered and
+// highlighted again, along with any after them whose tab stops moved or whose
+// starting lexer state changed. Returns non-zero if the row ends within a
+// multiline comment.
+int editor_update_chunks(struct editor_syntax* syntax, erow* row, int from) {
+  // find the chunk containing from
+  int lo = 0, hi = row->num_chunks - 1;
+  while(lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if(row->chunks[mid].start <= from) { lo = mid; } else { hi = mid - 1; }
+  }
+  int k = lo;
+
+  // adjust chunk lengths by the bytes added or removed
+  struct row_chunk* last = &row->chunks[row->num_chunks - 1];
+  int delta = row->size - (last->start + last->len);
+  row->chunks[k].dirty = 1;
+  if(delta > 0) {
+    row->chunks[k].len += delta;
+  } else {
+    int n = -delta;
+    for(int j=k; (n > 0) && (j < row->num_chunks); ++j) {
+      struct row_chunk* c = &row->chunks[j];
+      int o = (j == k) ? from - c->start : 0;
+      int take = (c->len - o < n) ? c->len - o : n;
+      c->len -= take;
+      n -= take;
+      c->dirty = 1;
+    }
+  }
+  for(int j=k+1; j<row->num_chunks; ++j) {
+    row->chunks[j].start = row->chunks[j-1].start + row->chunks[j-1].len;
+  }
+
+  // render chunks which changed or whose tab stops moved
+  for(int j=k; j<row->num_chunks; ++j) {
+    struct row_chunk* c = &row->chunks[j];
+    if(c->dirty || (c->tabs && (c->r_start % KILO_TAB_STOP != c->phase))) {
+      editor_render_chunk(row, j);
+    }
+  }
+
+  // drop chunks which are now empty and split those which have grown large
+  for(int j=0; j<row->num_chunks; ++j) {
+    struct row_chunk* c = &row->chunks[j];
+    if((c->len == 0) && (row->num_chunks > 1)) {
+      // the chunk after inherits the lexer state, or the one before has to
+      // give the state at the end of the row
+      if(j + 1 < row->num_chunks) {
+        row->chunks[j+1].hl_start = c->hl_start;
+        row->chunks[j+1].dirty = 1;
+      } else {
+        row->chunks[j-1].dirty = 1;
+      }
+      memmove(c, c + 1, (row->num_chunks - j - 1) * sizeof(struct row_chunk));
+      --row->num_chunks;
+      --j;
+    } else if(c->len > 2 * KILO_CHUNK_SIZE) {
+      editor_split_chunk(row, j);
+    }
+  }
+
+  // re-highlight from the first dirty chunk, or the one before if a token
+  // might span them, stopping once the lexer state matches what it was
+  int first = 0;
+  while((first < row->num_chunks) && !row->chunks[first].dirty) { ++first; }
+  if(first == row->num_chunks) { return row->hl_open_comment; }
+  if((first > 0) && (from - row->chunks[first].start < KILO_CHUNK_MARGIN)) {
+    --first;
+  }
+
+  struct hl_state st = row->chunks[first].hl_start;
+  for(int j=first; j<row->num_chunks; ++j) {
+    struct row_chunk* c = &row->chunks[j];
+    if((j > first) && !c->dirty && !memcmp(&st, &c->hl_start, sizeof(st))) {
+      // nothing changes until the next dirty chunk, if any
+      while((j < row->num_chunks) && !row->chunks[j].dirty) { ++j; }
+      if(j == row->num_chunks) { return row->hl_open_comment; }
+      c = &row->chunks[j];
+      st = c->hl_start;
+    }
+
+    c->hl_start = st;
+    if(st.skip < c->r_len) {
+      memset(&row->hl[c->r_start + st.skip], HL_NORMAL, c->r_len - st.skip);
     }
+    editor_highlight_span(syntax, row, c->r_start, c->r_start + c->r_len, &st);
+    c->dirty = 0;
   }
-  row->render[idx] = '\0';
-  row->r_size = idx;
 
-  // re-compute syntax highlighting
-  editor_update_syntax(row);
+  return (syntax != NULL) && st.in_comment;
+}
+
+// Update a row structure after modification by re-computing it's rendered form.
+// from is the offset of the first byte which changed.
+void editor_update_row(erow* row, int from) {
+  editor_row_invalidate_col_marks(row, from);
+
+  if(row->chunks != NULL) {
+    // only the chunks around the change need rendering and highlighting
+    uint64_t t = stats_begin();
+    int was_open = row->hl_open_comment;
+    row->hl_open_comment = editor_update_chunks(E.syntax, row, from);
+    editor_syntax_changed(row, was_open);
+    stats_end(&E.stats.highlight, t);
+  } else {
+    uint64_t t = stats_begin();
+    editor_render_row(row);
+    stats_end(&E.stats.render, t);
+
+    // re-compute syntax highlighting
+    t = stats_begin();
+    editor_update_syntax(row);
+    stats_end(&E.stats.highlight, t);
+  }
+
+  wrap_update_row(row);
+}
+
+// Initialise a row from an array of bytes and render it.
+void editor_init_row(erow* row, int idx, const uint8_t* buf, size_t len) {
+  row->idx = idx;
+  row->size = len;
+  row->chars = xmalloc(len + 1);
+  memcpy(row->chars, buf, len);
+  row->chars[len] = '\0';
+
+  row->r_size = 0;
+  row->render = NULL;
+  row->hl = NULL;
+  row->hl_open_comment = 0;
+  row->has_controls = 0;
+  row->col_marks = NULL;
+  row->num_col_marks = row->cap_col_marks = 0;
+  row->wrap_lines = 0;
+  row->chunks = NULL;
+  row->num_chunks = 0;
+  editor_render_row(row);
 }
 
 // Free resources associated with a row
@@ -597,6 +3211,8 @@ void editor_free_row(erow* row) {
   free(row->render);
   free(row->chars);
   free(row->hl);
+  free(row->col_marks);
+  free(row->chunks);
 }
 
 // Delete a row from the file
@@ -613,11 +3229,19 @@ void editor_del_row(int at) {
 
   // Each row now needs its idx reducing
   for(int i=at; i<E.num_rows; ++i) {
-    E.row[at].idx--;
+    E.row[i].idx--;
   }
 
+  // The row which took this one's place may now start in a different
+  // multiline comment state
+  if(at < E.num_rows) { editor_update_syntax(&E.row[at]); }
+
+  // Every row from here on has moved up the screen
+  editor_damage_rows_from(at);
+  wrap_invalidate();
+
   // Set dirty bit
-  E.dirty = 1;
+  E.dirty++;
 }
 
 // Insert a row in the file. If buf is non-NULL it is the contents of the new
@@ -627,7 +3251,7 @@ void editor_insert_row(int at, uint8_t *buf, size_t len) {
   if((at < 0) || (at > E.num_rows)) { return; }
 
   // Make room for new row and shuffle array
-  E.row = realloc(E.row, sizeof(erow) * (E.num_rows + 1));
+  E.row = xrealloc(E.row, sizeof(erow) * (E.num_rows + 1));
   memmove(&E.row[at+1], &E.row[at], sizeof(erow) * (E.num_rows - at));
   E.num_rows++;
 
@@ -636,31 +3260,23 @@ void editor_insert_row(int at, uint8_t *buf, size_t len) {
     E.row[i].idx++;
   }
 
-  // Initialise row
+  // Initialise and render row
   if(!buf) { len = 0; }
-  E.row[at].idx = at;
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, buf, len);
-  E.row[at].chars[len] = '\0';
-
-  // Re-render row
-  E.row[at].r_size = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  editor_update_row(&E.row[at]);
+  editor_init_row(&E.row[at], at, buf, len);
+  editor_update_syntax(&E.row[at]);
 
-  // set dirty bit
-  E.dirty = 1;
+  // Every row from here on has moved down the screen
+  editor_damage_rows_from(at);
+  wrap_invalidate();
 
-  // reset multiline comment flag
-  E.row[at].hl_open_comment = 0;
+  // set dirty bit
+  E.dirty++;
 }
 
 // Append an array of bytes to a row
 void editor_row_append_string(erow *row, uint8_t* s, size_t len) {
   // make space for new characters
-  row->chars = realloc(row->chars, row->size + len + 1);
+  row->chars = xrealloc(row->chars, row->size + len + 1);
 
   // copy bytes to end of row
   memcpy(&row->chars[row->size], s, len);
@@ -670,10 +3286,10 @@ void editor_row_append_string(erow *row, uint8_t* s, size_t len) {
   row->chars[row->size] = '\0';
 
   // re-render row
-  editor_update_row(row);
+  editor_update_row(row, row->size - len);
 
   // set dirty bit
-  E.dirty = 1;
+  E.dirty++;
 }
 
 // Insert a character into an existing row
@@ -682,7 +3298,7 @@ void editor_row_insert_char(erow *row, int at, uint8_t c) {
   if((at < 0) || (at > row->size)) { at = row->size; }
 
   // make room in buffer
-  row->chars = realloc(row->chars, row->size + 2);
+  row->chars = xrealloc(row->chars, row->size + 2);
 
   // shift characters from insertion point forward one
   memmove(&row->chars[at+1], &row->chars[at], row->size - at + 1);
@@ -692,10 +3308,10 @@ void editor_row_insert_char(erow *row, int at, uint8_t c) {
   row->chars[at] = c;
 
   // re-render row
-  editor_update_row(row);
+  editor_update_row(row, at);
 
   // set dirty bit
-  E.dirty = 1;
+  E.dirty++;
 }
 
 // Remove character at an index within row
@@ -708,16 +3324,18 @@ void editor_row_del_char(erow *row, int at) {
   row->size--;
 
   // re-render row
-  editor_update_row(row);
+  editor_update_row(row, at);
 
   // set sirty bit
-  E.dirty = 1;
+  E.dirty++;
 }
 
 //// EDITING OPERATIONS
 
 // insert a character at cursor
 void editor_insert_char(uint8_t c) {
+  if(editor_is_read_only()) { return; }
+
   // insert a blank row at end of file if we're on the last line
   if(E.cy == E.num_rows) {
     editor_insert_row(E.num_rows, U8(""), 0);
@@ -732,6 +3350,8 @@ void editor_insert_char(uint8_t c) {
 
 // delete character to the left of cursor
 void editor_del_char(void) {
+  if(editor_is_read_only()) { return; }
+
   // don't do anything at extreme ends of file
   if(E.cy == E.num_rows) { return; }
   if((E.cx == 0) && (E.cy == 0)) { return; }
@@ -759,6 +3379,8 @@ void editor_del_char(void) {
 
 // Insert a newline at current cursor
 void editor_insert_new_line(void) {
+  if(editor_is_read_only()) { return; }
+
   int new_cx = 0;
 
   if(E.cx == 0) {
@@ -793,7 +3415,7 @@ void editor_insert_new_line(void) {
     // ... and truncate the current row
     row->size = (E.cx == n_blank) ? 0 : E.cx;
     row->chars[row->size] = '\0';
-    editor_update_row(row);
+    editor_update_row(row, row->size);
 
     // the new cx should be the number of blank characters
     new_cx = n_blank;
@@ -814,6 +3436,24 @@ void editor_scroll(void) {
     E.rx = editor_row_cx_to_rx(&(E.row[E.cy]), E.cx);
   }
 
+  if(E.wrap_mode) {
+    // Scroll in screen lines, so that the cursor's line is on screen
+    wrap_ensure();
+    int sub = E.wrap_sub;
+    if(E.row_off > E.num_rows) { E.row_off = E.num_rows; }
+    if(sub >= wrap_lines_of(E.row_off)) { sub = wrap_lines_of(E.row_off) - 1; }
+
+    int top = wrap_prefix(E.row_off) + sub;
+    int line = wrap_prefix(E.cy) + E.rx / E.text_cols;
+    if(line < top) { top = line; }
+    if(line >= top + E.screen_rows) { top = line - E.screen_rows + 1; }
+
+    E.row_off = wrap_locate(top, &E.wrap_sub);
+    E.wrap_top = top;
+    E.col_off = 0;
+    return;
+  }
+
   if(E.cy < E.row_off) {
     E.row_off = E.cy;
   }
@@ -826,220 +3466,943 @@ void editor_scroll(void) {
     E.col_off = E.rx;
   }
 
-  if(E.rx >= E.col_off + E.screen_cols) {
-    E.col_off = E.rx - E.screen_cols + 1;
+  if(E.rx >= E.col_off + E.text_cols) {
+    E.col_off = E.rx - E.text_cols + 1;
   }
 
   assert(E.row_off >= 0);
   assert(E.col_off >= 0);
 }
 
-// Draw each row of the screen into the output buffer
-void editor_draw_rows(struct abuf *ab) {
-  for(int y=0; y<E.screen_rows; ++y) {
-    int file_row = y + E.row_off;
-
-    if(file_row >= E.num_rows) {
-      // off bottom of file
-
-      // only display welcome message if no lines
-      if((E.num_rows == 0) && (y == E.screen_rows / 3)) {
-        uint8_t welcome[30];
-        int welcomelen = snprintf((char*)welcome, sizeof(welcome),
-            "Kilo editor -- version %s", KILO_VERSION);
-        if(welcomelen > E.screen_cols) { welcomelen = E.screen_cols; }
-        int padding = (E.screen_cols - welcomelen) >> 1;
-        if(padding) {
-          ab_append(ab, U8("~"), 1);
-          --padding;
-        }
-        while(padding--) { ab_append(ab, U8(" "), 1); }
-        ab_append(ab, welcome, welcomelen);
-      } else {
-        ab_append(ab, U8("~"), 1);
-      }
+// Mark the screen lines showing a file row as needing to be redrawn. When
+// soft wrapping, a row whose line count has changed is handled by
+// wrap_update_row().
+void editor_damage_row(int file_row) {
+  int y = file_row - E.last_row_off, lines = 1;
+  if(E.wrap_mode) {
+    if(!wrap_last_line(file_row, &y)) { E.full_redraw = 1; return; }
+    lines = wrap_lines_of(file_row);
+  }
+  for(int k=(y < 0) ? -y : 0; (k < lines) && (y + k < E.damage_rows); ++k) {
+    E.damage[y + k] = 1;
+  }
+}
+
+// Mark the screen lines showing a file row and every row below it as needing
+// to be redrawn.
+void editor_damage_rows_from(int file_row) {
+  int y = file_row - E.last_row_off;
+  if(E.wrap_mode && !wrap_last_line(file_row, &y)) {
+    E.full_redraw = 1;
+    return;
+  }
+  if(y < 0) { y = 0; }
+  for(; y < E.damage_rows; ++y) { E.damage[y] = 1; }
+}
+
+// Mark the whole screen as needing to be redrawn.
+void editor_damage_all(void) {
+  E.full_redraw = 1;
+  E.frame_pending = 1;
+}
+
+// Work out the width of the line number gutter. It only changes when the
+// number of digits in the line count does, in which case everything is
+// redrawn.
+void editor_update_gutter(void) {
+  int width = 0;
+  if(E.line_numbers != LINE_NUMBERS_OFF) {
+    width = num_digits(E.num_rows > 0 ? E.num_rows : 1) + 1;
+    if(width >= E.screen_cols) { width = 0; }
+  }
+  if(width != E.gutter) {
+    E.gutter = width;
+    E.full_redraw = 1;
+  }
+  E.text_cols = E.screen_cols - E.gutter;
+}
+
+// Draw the line number of a file row into the gutter of screen line y. The
+// label is only formatted if it isn't already cached.
+void editor_draw_gutter(int y, int file_row) {
+  int number = file_row + 1;
+  struct gutter_label* label = &E.gutter_labels[y];
+  if(E.line_numbers == LINE_NUMBERS_RELATIVE) {
+    int distance = abs(file_row - E.cy);
+    if(distance) { number = distance; }
+    label = (distance < E.screen_rows) ? &E.gutter_labels[distance] : NULL;
+  }
+
+  uint8_t text[sizeof(label->text)];
+  uint8_t* p = text;
+  if(label && (label->number == number) && (label->width == E.gutter)) {
+    p = label->text;
+  } else {
+    if(label) { p = label->text; }
+    memset(p, ' ', E.gutter);
+    int x = E.gutter - 1;
+    for(int n = number; (n > 0) && (x > 0); n /= 10) { p[--x] = '0' + n % 10; }
+    if(label) {
+      label->number = number;
+      label->width = E.gutter;
+    }
+  }
+  grid_put(&E.back, y, 0, p, E.gutter, HL_LINE_NUMBER);
+}
+
+// Cycle the line number gutter between off, absolute and relative numbers.
+void editor_toggle_line_numbers(void) {
+  static const char* names[] = { "off", "absolute", "relative" };
+  E.line_numbers = (E.line_numbers + 1) % 3;
+  for(int y=0; y<E.damage_rows; ++y) { E.gutter_labels[y].number = -1; }
+  editor_damage_all();
+  editor_set_status_message("Line numbers %s", names[E.line_numbers]);
+}
+
+// Draw one line of the editor window into the back grid
+void editor_draw_row(int y) {
+  struct screen_grid* g = &E.back;
+  int file_row = y + E.row_off;
+  int col_off = E.col_off;
+
+  // when soft wrapping, lines are pieces of rows
+  if(E.wrap_mode) {
+    int sub;
+    file_row = wrap_locate(E.wrap_top + y, &sub);
+    col_off = sub * E.text_cols;
+  }
+
+  grid_clear_row(g, y);
+
+  if(file_row >= E.num_rows) {
+    // off bottom of file
+
+    // only display welcome message if no lines
+    if((E.num_rows == 0) && (y == E.screen_rows / 3)) {
+      uint8_t welcome[30];
+      int welcomelen = snprintf((char*)welcome, sizeof(welcome),
+          "Kilo editor -- version %s", KILO_VERSION);
+      if(welcomelen > E.screen_cols) { welcomelen = E.screen_cols; }
+      int padding = (E.screen_cols - welcomelen) >> 1;
+      grid_put(g, y, 0, U8("~"), 1, 0);
+      grid_put(g, y, padding, welcome, welcomelen, 0);
     } else {
-      // within file
-      int len = E.row[file_row].r_size - E.col_off;
-      if(len < 0) { len = 0; }
-      if(len > E.screen_cols) { len = E.screen_cols; }
-
-      // get rendered string from start of output line
-      uint8_t* c = &E.row[file_row].render[E.col_off];
-
-      // get highlight tokens
-      uint8_t* hl = &E.row[file_row].hl[E.col_off];
-
-      // append string with colours
-      int current_colour = -1;
-      for(int j=0; j<len; ++j) {
-        if(!isprint(c[j])) {
-          // display control characters in reverse video
-          uint8_t sym = (c[j] < 26) ? '@' + c[j] : '?';
-          ab_append(ab, U8("\x1b[7m"), 4);
-          ab_append(ab, &sym, 1);
-          ab_append(ab, U8("\x1b[m"), 3);
-
-          // Restore colour if necessary
-          if(current_colour != -1) {
-            uint8_t buf[16];
-            int clen = snprintf((char*)buf, sizeof(buf), "\x1b[%dm", current_colour);
-            ab_append(ab, buf, clen);
-          }
-        } else if(hl[j] == HL_NORMAL) {
-          // only reset colour if necessary
-          if(current_colour != -1) {
-            ab_append(ab, U8("\x1b[39m"), 5);
-            current_colour = -1;
-          }
-          ab_append(ab, &c[j], 1);
-        } else {
-          int colour = editor_syntax_to_colour(hl[j]);
-          if(colour != current_colour) {
-            uint8_t buf[16];
-            int clen = snprintf((char*)buf, sizeof(buf), "\x1b[%dm", colour);
-            ab_append(ab, buf, clen);
-            current_colour = colour;
-          }
-          ab_append(ab, &c[j], 1);
-        }
+      grid_put(g, y, 0, U8("~"), 1, 0);
+    }
+    return;
+  }
+
+  // within file, with the row's number on its first line
+  if(E.gutter && ((col_off == 0) || !E.wrap_mode)) {
+    editor_draw_gutter(y, file_row);
+  }
+  int len = E.row[file_row].r_size - col_off;
+  if(len <= 0) { return; }
+  if(len > E.text_cols) { len = E.text_cols; }
+
+  // get rendered string and highlight tokens from start of output line
+  uint8_t* c = &E.row[file_row].render[col_off];
+  uint8_t* hl = &E.row[file_row].hl[col_off];
+
+  // Runs of printable characters are copied along with their highlight
+  // tokens, which are their cell attributes. Most rows are one run.
+  uint8_t* glyphs = &g->glyphs[y * g->cols + E.gutter];
+  uint8_t* attrs = &g->attrs[y * g->cols + E.gutter];
+  if(!E.row[file_row].has_controls) {
+    memcpy(glyphs, c, len);
+    memcpy(attrs, hl, len);
+    return;
+  }
+  int j = 0;
+  while(j < len) {
+    int end = j + printable_span(&c[j], len - j);
+    memcpy(&glyphs[j], &c[j], end - j);
+    memcpy(&attrs[j], &hl[j], end - j);
+
+    // display control characters in reverse video
+    for(j = end; (j < len) && !IS_PRINTABLE(c[j]); ++j) {
+      glyphs[j] = (c[j] < 26) ? '@' + c[j] : '?';
+    }
+    memset(&attrs[end], CELL_REVERSE, j - end);
+  }
+}
+
+// Draw status bar into the back grid, unless it already shows the same thing
+void editor_draw_status_bar(void) {
+  int y = E.screen_rows;
+  char status[80], rstatus[80];
+  int len, rlen;
+
+  struct status_key key;
+  memset(&key, 0, sizeof(key));
+  strncpy(key.filename, E.filename ? E.filename : "", sizeof(key.filename) - 1);
+  key.dirty = (E.dirty != 0);
+  key.num_rows = E.num_rows;
+  key.cy = E.cy;
+  key.syntax = E.syntax;
+  key.loading = (E.loader != NULL);
+  key.line_base = E.line_base;
+  key.cur_buffer = E.cur_buffer;
+  key.num_buffers = E.num_buffers;
+  key.cols = E.screen_cols;
+  if(!E.full_redraw && !memcmp(&key, &E.status_key, sizeof(key))) { return; }
+  memcpy(&E.status_key, &key, sizeof(key));
+
+  // when there are several buffers, show which one this is
+  char num[32] = "";
+  if(E.num_buffers > 1) {
+    snprintf(num, sizeof(num), "[%d/%d] ", E.cur_buffer + 1, E.num_buffers);
+  }
+
+  if(E.loader) {
+    // line numbers are only known if the window's position is
+    len = snprintf(status, sizeof(status),
+        " %s%.20s - loading...", num, E.filename ? E.filename : "[No Name]");
+
+    if(E.line_base >= 0) {
+      rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/? ",
+          E.syntax ? E.syntax->filetype : "no ft", E.line_base + E.cy + 1);
+    } else {
+      rlen = snprintf(rstatus, sizeof(rstatus), "%s | ?/? ",
+          E.syntax ? E.syntax->filetype : "no ft");
+    }
+  } else {
+    len = snprintf(status, sizeof(status),
+        " %s%.20s - %d lines %s", num, E.filename ? E.filename : "[No Name]",
+        E.num_rows, E.dirty ? "(modified)" : "");
+
+    rlen = snprintf(rstatus, sizeof(rstatus),
+        "%s | %d/%d ",
+        E.syntax ? E.syntax->filetype : "no ft",
+        E.cy+1, E.num_rows);
+  }
+
+  // reverse video across the whole bar with the right-hand status flush
+  // right if it fits
+  grid_clear_row(&E.back, y);
+  memset(&E.back.attrs[y * E.back.cols], CELL_REVERSE, E.back.cols);
+  len = grid_put(&E.back, y, 0, (uint8_t*)status, len, CELL_REVERSE);
+  if(len + rlen <= E.screen_cols) {
+    grid_put(&E.back, y, E.screen_cols - rlen, (uint8_t*)rstatus, rlen,
+        CELL_REVERSE);
+  }
+}
+
+// Draw status message (if any) into the back grid, unless it hasn't changed
+void editor_draw_message_bar(void) {
+  if(!E.full_redraw && !E.status_msg_changed) { return; }
+  E.status_msg_changed = 0;
+
+  int y = E.screen_rows + 1;
+  grid_clear_row(&E.back, y);
+  grid_put(&E.back, y, 0, (uint8_t*)E.status_msg, strlen(E.status_msg), 0);
+}
+
+// qsort() comparison function for uint64_t values.
+int compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Draw the cost overlay into the top right of the back grid: the cost of the
+// last frame drawn and the median and 99th percentile over recent frames.
+// Times are shown in microseconds. The rows it covers are marked as damaged
+// so that they're drawn afresh, overlay and all, in the next frame.
+void editor_draw_cost_overlay(void) {
+  static const struct {
+    const char* label;
+    size_t offset;
+    uint64_t scale;
+  } lines[] = {
+    { "bytes", offsetof(struct frame_cost, bytes), 1 },
+    { "escapes", offsetof(struct frame_cost, escapes), 1 },
+    { "rows", offsetof(struct frame_cost, rows), 1 },
+    { "allocs", offsetof(struct frame_cost, allocs), 1 },
+    { "scroll us", offsetof(struct frame_cost, scroll), 1000 },
+    { "draw us", offsetof(struct frame_cost, draw), 1000 },
+    { "emit us", offsetof(struct frame_cost, emit), 1000 },
+    { "write us", offsetof(struct frame_cost, write), 1000 },
+  };
+  int num_lines = sizeof(lines) / sizeof(lines[0]);
+  int width = 35;
+  if((E.screen_rows <= num_lines + 1) || (E.screen_cols < width)) { return; }
+  int x = E.screen_cols - width;
+
+  struct frame_cost costs[KILO_COST_FRAMES];
+  uint64_t values[KILO_COST_FRAMES];
+  int n = render_recent_costs(costs);
+
+  char buf[64];
+  int len = snprintf(buf, sizeof(buf), " %-3d frames   %6s %6s %6s ", n,
+      "last", "p50", "p99");
+  grid_put(&E.back, 0, x, (uint8_t*)buf, len, CELL_REVERSE);
+  for(int k=0; k<num_lines; ++k) {
+    uint64_t last = 0, p50 = 0, p99 = 0;
+    for(int j=0; j<n; ++j) {
+      values[j] = *(uint64_t*)((char*)&costs[j] + lines[k].offset) /
+        lines[k].scale;
+    }
+    if(n > 0) {
+      last = values[n - 1];
+      qsort(values, n, sizeof(uint64_t), compare_u64);
+      p50 = values[(n * 50 + 99) / 100 - 1];
+      p99 = values[(n * 99 + 99) / 100 - 1];
+    }
+    len = snprintf(buf, sizeof(buf), " %-12s %6llu %6llu %6llu ",
+        lines[k].label, (unsigned long long)last, (unsigned long long)p50,
+        (unsigned long long)p99);
+    grid_put(&E.back, k + 1, x, (uint8_t*)buf, len, CELL_REVERSE);
+  }
+
+  for(int y=0; y<=num_lines; ++y) { E.damage[y] = 1; }
+}
+
+// Turn the cost overlay on or off.
+void editor_toggle_cost_overlay(void) {
+  E.cost_overlay = !E.cost_overlay;
+  editor_damage_all();
+  editor_set_status_message("Frame cost overlay %s",
+      E.cost_overlay ? "on" : "off");
+}
+
+// Work out what has to be redrawn following changes to the window size or
+// scroll position.
+void editor_update_damage(void) {
+  if((E.damage_rows != E.screen_rows) || (E.back.cols != E.screen_cols)) {
+    E.damage = xrealloc(E.damage, E.screen_rows);
+    memset(E.damage, 0, E.screen_rows);
+    E.damage_rows = E.screen_rows;
+    E.gutter_labels = xrealloc(E.gutter_labels,
+        E.screen_rows * sizeof(struct gutter_label));
+    for(int y=0; y<E.screen_rows; ++y) { E.gutter_labels[y].number = -1; }
+
+    grid_resize(&E.back, E.screen_rows + 2, E.screen_cols);
+    E.full_redraw = 1;
+  }
+
+  // A small vertical scroll is done by the terminal, so that only the lines
+  // exposed need drawing. Damage marked against the last frame's lines moves
+  // with them.
+  int delta = E.wrap_mode ? E.wrap_top - E.last_wrap_top :
+    E.row_off - E.last_row_off;
+  E.scroll_delta = 0;
+  if(delta && !E.full_redraw &&
+      (E.last_col_off == E.col_off) && (abs(delta) < E.screen_rows)) {
+    int keep = E.screen_rows - abs(delta);
+    if(delta > 0) {
+      memmove(E.damage, &E.damage[delta], keep);
+      memset(&E.damage[keep], 1, delta);
+    } else {
+      memmove(&E.damage[-delta], E.damage, keep);
+      memset(E.damage, 1, -delta);
+    }
+    grid_scroll(&E.back, 0, E.screen_rows, delta);
+    E.scroll_delta = delta;
+
+    // absolute line numbers move with their lines
+    if(E.line_numbers == LINE_NUMBERS_ABSOLUTE) {
+      struct gutter_label* labels = E.gutter_labels;
+      size_t size = keep * sizeof(struct gutter_label);
+      if(delta > 0) {
+        memmove(labels, &labels[delta], size);
+        for(int y=keep; y<E.screen_rows; ++y) { labels[y].number = -1; }
+      } else {
+        memmove(&labels[-delta], labels, size);
+        for(int y=0; y<-delta; ++y) { labels[y].number = -1; }
       }
+    }
+  } else if(delta || (E.last_col_off != E.col_off)) {
+    E.full_redraw = 1;
+  }
+
+  // Relative line numbers change on every line when the cursor row does
+  if((E.line_numbers == LINE_NUMBERS_RELATIVE) && (E.cy != E.last_cy)) {
+    memset(E.damage, 1, E.screen_rows);
+  }
+  E.last_cy = E.cy;
+
+  E.last_cols = E.screen_cols;
+  E.last_row_off = E.row_off;
+  E.last_col_off = E.col_off;
+  E.last_wrap_top = E.wrap_top;
+}
+
+// Get the size of the terminal less the status and message bars.
+void editor_get_size(int* rows, int* cols) {
+  if(-1 == E.term->get_size(rows, cols)) { die("window size"); }
+
+  // Make room for status bar and message
+  *rows -= 2;
+  if(*rows < 1) { die("terminal too small"); }
+}
+
+// Lay the window out again if the terminal has been resized, however many
+// times, since the last frame. The cursor stays on the same screen line if it
+// still fits and the window is re-wrapped, if soft wrapping, at the new width.
+void editor_layout(void) {
+  if(terminal_take_resize()) { E.resize_pending = 1; }
+  if(!E.resize_pending) { return; }
+  E.resize_pending = 0;
+
+  int rows, cols;
+  editor_get_size(&rows, &cols);
+  if((rows == E.screen_rows) && (cols == E.screen_cols)) { return; }
+  E.screen_rows = rows;
+  E.screen_cols = cols;
+  editor_update_gutter();
+
+  int anchor = E.last_cursor_y;
+  if(anchor >= rows) { anchor = rows - 1; }
+  if(anchor < 0) { anchor = 0; }
+
+  if(E.wrap_mode) {
+    // The index is rebuilt at the new width, which takes time in proportion
+    // to the length of the file (see wrap_ensure()), and the window placed so
+    // that the cursor's screen line is anchor lines down
+    wrap_ensure();
+    int rx = (E.cy < E.num_rows) ? editor_row_cx_to_rx(&E.row[E.cy], E.cx) : 0;
+    int top = wrap_prefix(E.cy) + rx / E.text_cols - anchor;
+    E.row_off = wrap_locate((top > 0) ? top : 0, &E.wrap_sub);
+  } else {
+    E.row_off = (E.cy > anchor) ? E.cy - anchor : 0;
+  }
+  editor_damage_all();
+}
+
+// Refresh screen display. The next frame is built into the back grid from the
+// damaged rows and published for the render thread to draw.
+void editor_refresh_screen(void) {
+  uint64_t t = (E.stats.frames == 0) ? stats_begin() : 0;
+  uint64_t allocs = E.stats.allocs;
+  struct frame_cost cost = { 0 };
+  uint64_t start = now_ns();
+
+  // Set layout and scroll position
+  editor_layout();
+  editor_update_gutter();
+  editor_scroll();
+  editor_update_damage();
+  uint64_t scrolled = now_ns();
+
+  // Build the back grid
+  for(int y=0; y<E.screen_rows; ++y) {
+    if(E.full_redraw || E.damage[y]) { editor_draw_row(y); }
+    E.damage[y] = 0;
+  }
+  editor_draw_status_bar();
+  editor_draw_message_bar();
+  E.full_redraw = 0;
+
+  cost.scroll = scrolled - start;
+  cost.draw = now_ns() - scrolled;
+  cost.allocs = E.stats.allocs - allocs;
+  if(E.cost_overlay) { editor_draw_cost_overlay(); }
+
+  int cursor_y = E.cy - E.row_off, cursor_x = E.rx - E.col_off;
+  if(E.wrap_mode) {
+    cursor_y = wrap_prefix(E.cy) + E.rx / E.text_cols - E.wrap_top;
+    cursor_x = E.rx % E.text_cols;
+  }
+  cursor_x += E.gutter;
+  render_publish(&E.back, E.screen_rows, cursor_y, cursor_x, E.scroll_delta,
+      E.repaint, &cost);
+  E.last_cursor_y = cursor_y;
+  E.repaint = 0;
+  E.frame_pending = 0;
+
+  // Allocations are counted from every thread, so a background load or the
+  // render thread may be counted here too
+  E.stats.frame_allocs = E.stats.allocs - allocs;
+  if(E.stats.frame_allocs) { ++E.stats.alloc_frames; }
+  E.last_frame = now_ns();
+
+  if(E.stats.frames++ == 0) {
+    stats_end(&E.stats.first_refresh, t);
+    if(t) { E.stats.first_frame = now_ns() - E.stats.start; }
+  }
+}
+
+// Show a summary of the statistics in the message bar.
+void editor_show_stats(void) {
+  struct editor_stats* st = &E.stats;
+  if(!st->enabled) {
+    editor_set_status_message("Statistics are only gathered with --stats");
+    return;
+  }
+
+  editor_set_status_message("read %.0fms split %.0fms row %.0fms hl %.0fms "
+      "allocs %llu (last frame %llu) skipped %d rss %.0fMiB", st->read / 1e6,
+      st->split / 1e6, st->render / 1e6, st->highlight / 1e6,
+      (unsigned long long)st->allocs, (unsigned long long)st->frame_allocs,
+      st->skipped_frames, stats_peak_rss() / (1024.0 * 1024.0));
+}
+
+// Set a status message. Takes a format string and arguments a la printf().
+void editor_set_status_message(const char* fmt, ...) {
+  va_list ap;
+
+  // Format message
+  va_start(ap, fmt);
+  vsnprintf(E.status_msg, sizeof(E.status_msg), fmt, ap);
+  va_end(ap);
+
+  // Start the timeout
+  E.status_msg_expiry = E.status_msg[0] ?
+    now_ns() + KILO_MSG_TIMEOUT * 1000000000ull : 0;
+  E.status_msg_changed = 1;
+  E.frame_pending = 1;
+}
+
+// Clear the status message if it has timed out. Returns non-zero if it has.
+int editor_expire_message(void) {
+  if(!E.status_msg_expiry || (now_ns() < E.status_msg_expiry)) { return 0; }
+  E.status_msg[0] = '\0';
+  E.status_msg_expiry = 0;
+  E.status_msg_changed = 1;
+  E.frame_pending = 1;
+  return 1;
+}
 
-      // reset colour before next line
-      ab_append(ab, U8("\x1b[39m"), 5);
+//// FILE MAPPING
+
+// Map a file's contents into memory. If whole is non-zero, all of the file is
+// about to be read and so it is read in up front. Returns -1 iff there was an
+// error in which case errno is set.
+int file_map_open(struct file_map* fm, const char* filename, int whole) {
+  uint64_t t = stats_begin();
+  int fd = open(filename, O_RDONLY);
+  if(fd == -1) { return -1; }
+
+  if(-1 == fstat(fd, &fm->st)) { close(fd); return -1; }
+
+  fm->data = NULL;
+  fm->size = 0;
+  fm->mapped = 0;
+
+  // Regular files can be mapped directly
+  if(S_ISREG(fm->st.st_mode) && (fm->st.st_size > 0)) {
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if(whole) { flags |= MAP_POPULATE; }
+#else
+    (void)whole;
+#endif
+    void* p = mmap(NULL, fm->st.st_size, PROT_READ, flags, fd, 0);
+    if(p != MAP_FAILED) {
+      madvise(p, fm->st.st_size, MADV_SEQUENTIAL);
+      fm->data = p;
+      fm->size = fm->st.st_size;
+      fm->mapped = 1;
+      close(fd);
+      stats_end(&E.stats.read, t);
+      return 0;
     }
+  }
 
-    // Clear remainder of line
-    ab_append(ab, U8("\x1b[K"), 3);
+  // Otherwise, slurp the file a block at a time
+  size_t cap = 0;
+  ssize_t n_read;
+  do {
+    if(fm->size == cap) {
+      cap = cap ? cap * 2 : 65536;
+      fm->data = xrealloc(fm->data, cap);
+    }
+    n_read = read(fd, &fm->data[fm->size], cap - fm->size);
+    if(n_read > 0) { fm->size += n_read; }
+  } while((n_read > 0) || ((n_read == -1) && (errno == EINTR)));
 
-    // Add newline
-    ab_append(ab, U8("\r\n"), 2);
+  close(fd);
+  if(n_read == -1) { free(fm->data); return -1; }
+  stats_end(&E.stats.read, t);
+  return 0;
+}
+
+// Release a file mapping.
+void file_map_close(struct file_map* fm) {
+  if(fm->mapped) {
+    munmap(fm->data, fm->size);
+  } else {
+    free(fm->data);
   }
+  fm->data = NULL;
+  fm->size = 0;
 }
 
-// Draw status bar
-void editor_draw_status_bar(struct abuf *ab) {
-  // reverse video
-  ab_append(ab, U8("\x1b[7m"), 4);
+//// LINE INDEX
+
+// Find the offset at which a (1-based) line starts without building an index.
+// Lines beyond the end of the data map to the start of the last line. The line
+// actually found is returned, 0-based, in found.
+uint64_t find_line_offset(const uint8_t* data, uint64_t size, uint64_t line,
+    uint64_t* found) {
+  uint64_t to_skip = (line > 0) ? line - 1 : 0;
+  uint64_t pos = 0;
+
+  // skip whole blocks which end before the line we want
+  while(pos < size) {
+    uint64_t block = size - pos;
+    if(block > KILO_COUNT_BLOCK) { block = KILO_COUNT_BLOCK; }
+
+    uint64_t n = count_byte(&data[pos], block, '\n');
+    if(n >= to_skip) { break; }
+    to_skip -= n;
+    pos += block;
+  }
 
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status),
-      " %.20s - %d lines %s", E.filename ? E.filename : "[No Name]",
-      E.num_rows, E.dirty ? "(modified)" : "");
-  if(len > E.screen_cols) { len = E.screen_cols; }
-  ab_append(ab, (uint8_t*)status, len);
-
-  int rlen = snprintf(rstatus, sizeof(rstatus),
-      "%s | %d/%d ",
-      E.syntax ? E.syntax->filetype : "no ft",
-      E.cy+1, E.num_rows);
-
-  while(len < E.screen_cols) {
-    if(E.screen_cols - len == rlen) {
-      ab_append(ab, (uint8_t*)rstatus, rlen);
-      break;
+  // find the exact newline within the block
+  for(; to_skip > 0; --to_skip) {
+    const uint8_t* p = memchr(&data[pos], '\n', size - pos);
+    if(p == NULL) { break; }
+    pos = p - data + 1;
+  }
+
+  // each newline skipped is a line, unless we've run off the end, in which
+  // case back up to the start of the last line
+  *found = ((line > 0) ? line - 1 : 0) - to_skip;
+  if((pos == size) && (size > 0)) {
+    const uint8_t* p = memrchr(data, '\n', size - 1);
+    pos = p ? (uint64_t)(p - data + 1) : 0;
+    if(data[size - 1] == '\n') { --*found; }
+  }
+
+  return pos;
+}
+
+// 64-bit FNV-1a hash of a block of bytes, continuing from hash h.
+uint64_t fnv1a(uint64_t h, const uint8_t* p, size_t len) {
+  while(len--) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Initial value for fnv1a()
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+// Hash KILO_INDEX_SAMPLES blocks spread evenly over the first size bytes of
+// data. Any change to a file is likely (but not certain) to change this hash
+// and it is cheap to compute for even very large files.
+uint64_t line_index_sample_hash(const uint8_t* data, uint64_t size) {
+  uint64_t h = fnv1a(FNV1A_INIT, (const uint8_t*)&size, sizeof(size));
+  uint64_t block = KILO_INDEX_SAMPLE_SIZE;
+  if(block > size) { block = size; }
+
+  for(int i=0; i<KILO_INDEX_SAMPLES; ++i) {
+    uint64_t at = (size - block) / (KILO_INDEX_SAMPLES - 1) * i;
+    h = fnv1a(h, &data[at], block);
+  }
+
+  return h;
+}
+
+// Ensure an index owns its array of line starts, copying it out of any mapped
+// sidecar.
+void line_index_own(struct line_index* idx) {
+  if(idx->map == NULL) { return; }
+
+  uint64_t cap = (idx->num_lines > 512) ? idx->num_lines * 2 : 1024;
+  uint64_t* starts = xmalloc(sizeof(uint64_t) * cap);
+  memcpy(starts, idx->starts, sizeof(uint64_t) * idx->num_lines);
+
+  munmap(idx->map, idx->map_len);
+  idx->map = NULL;
+  idx->map_len = 0;
+  idx->starts = starts;
+  idx->cap = cap;
+}
+
+// Append a line start to an index.
+void line_index_push(struct line_index* idx, uint64_t start) {
+  line_index_own(idx);
+
+  if(idx->num_lines == idx->cap) {
+    idx->cap = idx->cap ? idx->cap * 2 : 1024;
+    idx->starts = xrealloc(idx->starts, sizeof(uint64_t) * idx->cap);
+  }
+  idx->starts[idx->num_lines++] = start;
+}
+
+// Scan data[from, size) for newlines and extend the index with the lines found.
+// If from is non-zero, the index must already cover data[0, from).
+void line_index_scan(struct line_index* idx, const uint8_t* data,
+    uint64_t from, uint64_t size) {
+  if(from == 0) {
+    if(size > 0) { line_index_push(idx, 0); }
+  } else {
+    // a newline at the end of the indexed region starts a new line
+    --from;
+  }
+
+  const uint8_t* p = &data[from];
+  const uint8_t* end = &data[size];
+  while((p < end) && ((p = memchr(p, '\n', end - p)) != NULL)) {
+    ++p;
+    if(p < end) { line_index_push(idx, p - data); }
+  }
+}
+
+// Return the offset and length of line i in data, excluding any line ending.
+void line_index_line(struct line_index* idx, const uint8_t* data,
+    uint64_t size, uint64_t i, uint64_t* start, uint64_t* len) {
+  uint64_t end = (i + 1 < idx->num_lines) ? idx->starts[i + 1] : size;
+  *start = idx->starts[i];
+  *len = end - *start;
+  if((*len > 0) && ((data[end - 1] == '\n') || (data[end - 1] == '\r'))) {
+    --*len;
+  }
+}
+
+// Return the line containing the given offset.
+uint64_t line_index_find(struct line_index* idx, uint64_t offset) {
+  uint64_t lo = 0, hi = idx->num_lines;
+
+  // find the last line starting at or before offset
+  while(hi - lo > 1) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if(idx->starts[mid] <= offset) { lo = mid; } else { hi = mid; }
+  }
+
+  return lo;
+}
+
+// Release resources associated with an index.
+void line_index_free(struct line_index* idx) {
+  if(idx->map) {
+    munmap(idx->map, idx->map_len);
+  } else if(idx->cap) {
+    free(idx->starts);
+  }
+  memset(idx, 0, sizeof(*idx));
+}
+
+// Compute the path of the sidecar index for a file. Returns NULL if there is
+// nowhere to put the cache. The returned string should be free()-ed.
+char* line_index_sidecar_path(const char* filename, int create_dir) {
+  char* real = realpath(filename, NULL);
+  if(real == NULL) { return NULL; }
+  uint64_t h = fnv1a(FNV1A_INIT, U8(real), strlen(real));
+  free(real);
+
+  char dir[4096];
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  int len;
+  if(xdg && xdg[0]) {
+    len = snprintf(dir, sizeof(dir), "%s/kilo", xdg);
+  } else if(home && home[0]) {
+    len = snprintf(dir, sizeof(dir), "%s/.cache/kilo", home);
+  } else {
+    return NULL;
+  }
+  if((len < 0) || ((size_t)len >= sizeof(dir))) { return NULL; }
+
+  if(create_dir) {
+    // create each component in turn, ignoring those which exist
+    for(char* p = dir + 1; *p; ++p) {
+      if(*p != '/') { continue; }
+      *p = '\0';
+      mkdir(dir, 0700);
+      *p = '/';
     }
+    mkdir(dir, 0700);
+  }
+
+  char* path = xmalloc(len + 32);
+  snprintf(path, len + 32, "%s/%016llx.idx", dir, (unsigned long long)h);
+  return path;
+}
+
+// Try to load a sidecar index for the mapped file. If the file is unchanged
+// since it was indexed, the index is used as-is. If the file has only grown,
+// only the appended bytes are scanned. Returns 0 iff the index was loaded,
+// otherwise idx is left empty.
+int line_index_load_sidecar(struct line_index* idx, const char* filename,
+    struct file_map* fm) {
+  char* path = line_index_sidecar_path(filename, 0);
+  if(path == NULL) { return -1; }
+
+  int fd = open(path, O_RDONLY);
+  free(path);
+  if(fd == -1) { return -1; }
+
+  struct stat st;
+  if((-1 == fstat(fd, &st)) ||
+      ((size_t)st.st_size < sizeof(struct line_index_header))) {
+    close(fd);
+    return -1;
+  }
+
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) { return -1; }
+
+  struct line_index_header* hdr = map;
+  if(memcmp(hdr->magic, KILO_INDEX_MAGIC, sizeof(hdr->magic)) ||
+      (hdr->num_lines > (uint64_t)st.st_size) ||
+      ((size_t)st.st_size != sizeof(*hdr) + sizeof(uint64_t) * hdr->num_lines) ||
+      (hdr->file_size > fm->size) ||
+      (hdr->sample_hash != line_index_sample_hash(fm->data, hdr->file_size))) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  uint64_t indexed_size = hdr->file_size;
+  int unchanged = (indexed_size == fm->size) &&
+    (hdr->mtime_sec == fm->st.st_mtim.tv_sec) &&
+    (hdr->mtime_nsec == fm->st.st_mtim.tv_nsec);
 
-    ab_append(ab, U8(" "), 1);
-    ++len;
+  // a file re-written in place needs a full re-scan
+  if(!unchanged && (indexed_size == fm->size)) {
+    munmap(map, st.st_size);
+    return -1;
   }
 
-  // normal video and new line
-  ab_append(ab, U8("\x1b[m\r\n"), 6);
-}
+  idx->starts = (uint64_t*)(hdr + 1);
+  idx->num_lines = hdr->num_lines;
+  idx->cap = 0;
+  idx->map = map;
+  idx->map_len = st.st_size;
 
-// Draw status message (if any)
-void editor_draw_message_bar(struct abuf* ab) {
-  // Clear any existing line
-  ab_append(ab, U8("\x1b[K"), 3);
+  if(unchanged) { return 0; }
 
-  int msg_len = strlen(E.status_msg);
-  if(msg_len > E.screen_cols) { msg_len = E.screen_cols; }
-  if(msg_len && (time(NULL) - E.status_msg_time < KILO_MSG_TIMEOUT)) {
-    ab_append(ab, (uint8_t*)E.status_msg, msg_len);
-  }
+  // the file has only grown so just scan the tail
+  line_index_scan(idx, fm->data, indexed_size, fm->size);
+  return 1;
 }
 
-// Refresh screen display
-void editor_refresh_screen(void) {
-  struct abuf ab = ABUF_INIT;
-
-  // Set scroll position
-  editor_scroll();
+// Write the index of the mapped file to its sidecar. Errors are silently
+// ignored since the sidecar is only ever an optimisation.
+void line_index_save_sidecar(struct line_index* idx, const char* filename,
+    struct file_map* fm) {
+  char* path = line_index_sidecar_path(filename, 1);
+  if(path == NULL) { return; }
+
+  // write to a temporary file and rename it into place
+  size_t tmp_len = strlen(path) + 32;
+  char* tmp = xmalloc(tmp_len);
+  snprintf(tmp, tmp_len, "%s.%ld", path, (long)getpid());
+
+  struct line_index_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, KILO_INDEX_MAGIC, sizeof(hdr.magic));
+  hdr.file_size = fm->size;
+  hdr.mtime_sec = fm->st.st_mtim.tv_sec;
+  hdr.mtime_nsec = fm->st.st_mtim.tv_nsec;
+  hdr.sample_hash = line_index_sample_hash(fm->data, fm->size);
+  hdr.num_lines = idx->num_lines;
+
+  int ok = 0;
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if(fd != -1) {
+    ok = (write(fd, &hdr, sizeof(hdr)) == sizeof(hdr));
+
+    const uint8_t* p = (const uint8_t*)idx->starts;
+    size_t remaining = sizeof(uint64_t) * idx->num_lines;
+    while(ok && remaining) {
+      ssize_t n = write(fd, p, remaining);
+      if(n <= 0) { ok = 0; break; }
+      p += n;
+      remaining -= n;
+    }
 
-  // Hide cursor
-  ab_append(&ab, U8("\x1b[?25l"), 6);
+    if(close(fd) == -1) { ok = 0; }
+  }
 
-  // Cursor -> top-left
-  ab_append(&ab, U8("\x1b[H"), 3);
+  if(!ok || (rename(tmp, path) == -1)) { unlink(tmp); }
 
-  // Draw the screen
-  editor_draw_rows(&ab);
-  editor_draw_status_bar(&ab);
-  editor_draw_message_bar(&ab);
+  free(tmp);
+  free(path);
+}
 
-  // Cursor -> current position
-  uint8_t buf[32];
-  int buf_len = snprintf((char*)buf, sizeof(buf),
-      "\x1b[%d;%dH", (E.cy - E.row_off) + 1, (E.rx - E.col_off) + 1);
-  ab_append(&ab, buf, buf_len);
+// Build the line index for a mapped file, using and refreshing its sidecar if
+// the file is large enough to warrant one.
+void line_index_build(struct line_index* idx, const char* filename,
+    struct file_map* fm) {
+  uint64_t t = stats_begin();
+  memset(idx, 0, sizeof(*idx));
 
-  // Show cursor
-  ab_append(&ab, U8("\x1b[?25h"), 6);
+  int use_sidecar = fm->mapped && (fm->size >= KILO_INDEX_MIN_SIZE);
+  int loaded = use_sidecar ? line_index_load_sidecar(idx, filename, fm) : -1;
 
-  // Output buffer
-  if(-1 == write(STDOUT_FILENO, ab.buf, ab.len)) {
-    die("write");
+  if(loaded == -1) {
+    line_index_scan(idx, fm->data, 0, fm->size);
   }
+  stats_end(&E.stats.split, t);
 
-  // Free buffer
-  ab_free(&ab);
+  // there's nothing to save if the sidecar was up to date
+  if(use_sidecar && (loaded != 0)) { line_index_save_sidecar(idx, filename, fm); }
 }
 
-// Set a status message. Takes a format string and arguments a la printf().
-void editor_set_status_message(const char* fmt, ...) {
-  va_list ap;
+//// FILE I/O
 
-  // Format message
-  va_start(ap, fmt);
-  vsnprintf(E.status_msg, sizeof(E.status_msg), fmt, ap);
-  va_end(ap);
+// Build rendered and highlighted rows for each line in an index. The returned
+// rows are independent of the editor state so this may be called from any
+// thread.
+void editor_build_rows(const uint8_t* data, uint64_t size,
+    struct line_index* idx, struct editor_syntax* syntax,
+    erow** rows, int* num_rows) {
+  *num_rows = idx->num_lines;
+  *rows = xmalloc(sizeof(erow) * idx->num_lines);
+
+  // render every row and then highlight them so that each can be timed
+  uint64_t t = stats_begin();
+  for(uint64_t i=0; i<idx->num_lines; ++i) {
+    uint64_t start, len;
+    line_index_line(idx, data, size, i, &start, &len);
+    editor_init_row(&(*rows)[i], i, &data[start], len);
+  }
+  stats_end(&E.stats.render, t);
 
-  // Record time
-  E.status_msg_time = time(NULL);
+  t = stats_begin();
+  int in_comment = 0;
+  for(uint64_t i=0; i<idx->num_lines; ++i) {
+    editor_highlight_row(syntax, &(*rows)[i], in_comment);
+    in_comment = (*rows)[i].hl_open_comment;
+  }
+  stats_end(&E.stats.highlight, t);
 }
 
-//// FILE I/O
+// Replace the editor's rows, freeing any existing ones.
+void editor_set_rows(erow* rows, int num_rows) {
+  for(int i=0; i<E.num_rows; ++i) {
+    editor_free_row(&E.row[i]);
+  }
+  free(E.row);
+
+  E.row = rows;
+  E.num_rows = num_rows;
+  wrap_invalidate();
+  editor_damage_all();
+}
 
 // Read a file into the editor.
 void editor_open(const char* filename) {
-  FILE *fp = fopen(filename, "r");
-  if(!fp) { die("fopen"); }
+  struct file_map fm;
+  if(-1 == file_map_open(&fm, filename, 1)) { die("open"); }
 
   free(E.filename);
-  E.filename = strdup(filename);
+  E.filename = xstrdup(filename);
 
   // match syntax highlighting
-  editor_select_syntax_highlight();
+  E.syntax = editor_syntax_for_filename(E.filename);
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-
-  while((linelen = getline(&line, &linecap, fp)) != -1) {
-    if((linelen > 0) && (
-          (line[linelen - 1] == '\n') || (line[linelen - 1] == '\r'))) {
-      --linelen;
-    }
+  // find where each line starts
+  struct line_index idx;
+  line_index_build(&idx, filename, &fm);
 
-    editor_insert_row(E.num_rows, (uint8_t*) line, linelen);
-  }
+  erow* rows;
+  int num_rows;
+  editor_build_rows(fm.data, fm.size, &idx, E.syntax, &rows, &num_rows);
+  editor_set_rows(rows, num_rows);
 
-  free(line);
-  fclose(fp);
+  line_index_free(&idx);
+  file_map_close(&fm);
 
   // Reset dirty bit
   E.dirty = 0;
+
+  stats_loaded();
 }
 
 // Write all the rows to a single string. Returns the length of the allocated
@@ -1055,7 +4418,7 @@ char* editor_rows_to_string(int *buflen) {
   if(buflen) { *buflen = totlen; }
 
   // Allocate a buffer to hold the string
-  char *buf = malloc(totlen);
+  char *buf = xmalloc(totlen);
 
   // Walk each row copying the bytes
   char *p = buf;
@@ -1069,8 +4432,166 @@ char* editor_rows_to_string(int *buflen) {
   return buf;
 }
 
+// Write all of a buffer to a file descriptor. Returns -1 iff there was an
+// error.
+int write_all(int fd, const uint8_t* buf, size_t len) {
+  while(len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if(n == -1) {
+      if(errno == EINTR) { continue; }
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Stream the rows to a file descriptor via a fixed size buffer so that no
+// memory is allocated. Returns -1 iff there was an error.
+int editor_write_rows(int fd) {
+  uint8_t buf[1 << 16];
+  size_t used = 0;
+
+  for(int j=0; j < E.num_rows; ++j) {
+    const uint8_t* p = E.row[j].chars;
+    size_t remaining = E.row[j].size + 1; // + 1 for newline
+
+    while(remaining > 0) {
+      if(used == sizeof(buf)) {
+        if(-1 == write_all(fd, buf, used)) { return -1; }
+        used = 0;
+      }
+
+      size_t n = sizeof(buf) - used;
+      if(n > remaining) { n = remaining; }
+      if(remaining == n) {
+        // last chunk of row; the final byte is the newline
+        memcpy(&buf[used], p, n - 1);
+        buf[used + n - 1] = '\n';
+      } else {
+        memcpy(&buf[used], p, n);
+      }
+      used += n;
+      p += n;
+      remaining -= n;
+    }
+  }
+
+  return write_all(fd, buf, used);
+}
+
+// Save the buffer from a forked child process. The child sees a copy-on-write
+// snapshot of the rows so the editor can carry on as soon as it has forked.
+void editor_save_in_background(int64_t len) {
+  if(E.save_pid) {
+    // Only one save may be in flight; save again when it is done
+    E.buffers[E.cur_buffer].save_queued = 1;
+    editor_set_status_message("Save queued");
+    return;
+  }
+
+  // The file is written alongside and renamed over the original, so that a
+  // child which fails or is killed leaves the original alone. The name is made
+  // here since the child must not allocate.
+  size_t tmp_size = strlen(E.filename) + 32;
+  char* tmp = xmalloc(tmp_size);
+  snprintf(tmp, tmp_size, "%s.%ld.kilo", E.filename, (long)getpid());
+
+  pid_t pid = fork();
+  if(pid == -1) {
+    editor_set_status_message("error saving: %s", strerror(errno));
+    free(tmp);
+    return;
+  }
+
+  if(pid == 0) {
+    // Child: write the file and report any error via our exit status, which
+    // only has room for errno values from 1 to 255. Use _exit() so that the
+    // terminal is left alone.
+    struct stat st;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int keep_mode = (fd != -1) && (0 == stat(E.filename, &st));
+    if((fd == -1) || (keep_mode && (-1 == fchmod(fd, st.st_mode & 07777))) ||
+        (-1 == editor_write_rows(fd)) || (-1 == fsync(fd)) ||
+        (-1 == close(fd)) || (-1 == rename(tmp, E.filename))) {
+      int err = errno;
+      if(fd != -1) { unlink(tmp); }
+      _exit(((err > 0) && (err < 256)) ? err : EIO);
+    }
+    _exit(0);
+  }
+  free(tmp);
+
+  E.save_pid = pid;
+  E.save_buffer = E.cur_buffer;
+  E.save_dirty = E.dirty;
+  E.save_len = len;
+  editor_set_status_message("Saving %lld bytes...", (long long)len);
+}
+
+// Reap a finished background save and report the outcome, then start the saves
+// queued behind it until one goes to the background again. Returns -1 iff the
+// save reaped failed.
+int editor_reap_save(void) {
+  E.child_exited = 0;
+  if(!E.save_pid) { return 0; }
+
+  int status;
+  pid_t pid = waitpid(E.save_pid, &status, WNOHANG);
+  if(pid == 0) { return 0; } // still going
+  E.save_pid = 0;
+
+  int cur_buffer = E.cur_buffer, failed = 1;
+  if((pid == -1) || !WIFEXITED(status)) {
+    editor_set_status_message("error saving: child terminated abnormally");
+  } else if(WEXITSTATUS(status) != 0) {
+    editor_set_status_message("error saving: %s",
+        strerror(WEXITSTATUS(status)));
+  } else {
+    failed = 0;
+    editor_set_status_message("%lld bytes written", (long long)E.save_len);
+
+    // The buffer is only clean if it hasn't changed since we forked
+    editor_switch_buffer(E.save_buffer);
+    if(E.dirty == E.save_dirty) { E.dirty = 0; }
+  }
+
+  for(int i=0; (i < E.num_buffers) && !E.save_pid; ++i) {
+    if(!E.buffers[i].save_queued) { continue; }
+    E.buffers[i].save_queued = 0;
+    editor_switch_buffer(i);
+    editor_save();
+  }
+  editor_switch_buffer(cur_buffer);
+  return failed ? -1 : 0;
+}
+
+// Wait for any background save, and any queued behind it, to finish. Each is
+// reaped by editor_reap_save() so that failures are reported. Returns -1 iff
+// one failed.
+int editor_wait_for_save(void) {
+  if(!E.save_pid) { return 0; }
+
+  editor_set_status_message("Waiting for save to finish...");
+  editor_refresh_screen();
+
+  int failed = 0;
+  while(E.save_pid) {
+    // wait without reaping, leaving that to editor_reap_save()
+    siginfo_t info;
+    while((-1 == waitid(P_PID, E.save_pid, &info, WEXITED | WNOWAIT)) &&
+        (errno == EINTR)) {
+    }
+    if(-1 == editor_reap_save()) { failed = 1; }
+  }
+  return failed ? -1 : 0;
+}
+
 // Write the editor contents to the current filename.
 void editor_save(void) {
+  if(editor_is_read_only()) { return; }
+
   if(E.filename == NULL) {
     // Prompt user for filename
     E.filename = editor_prompt("Save as: %s", NULL);
@@ -1083,6 +4604,16 @@ void editor_save(void) {
   // Match syntax highlighting
   editor_select_syntax_highlight();
 
+  // Large buffers are saved in the background
+  int64_t total = 0;
+  for(int j=0; j < E.num_rows; ++j) {
+    total += E.row[j].size + 1;
+  }
+  if(E.save_pid || (total >= KILO_BGSAVE_MIN_SIZE)) {
+    editor_save_in_background(total);
+    return;
+  }
+
   // Convert editor rows to a string for saving
   int len;
   char *buf = editor_rows_to_string(&len);
@@ -1113,6 +4644,477 @@ void editor_save(void) {
   editor_set_status_message("error saving: %s", strerror(errno));
 }
 
+//// BUFFERS
+
+// Copy the current buffer's state out of the editor configuration.
+void editor_stash_buffer(struct editor_buffer* b) {
+  b->cx = E.cx;
+  b->cy = E.cy;
+  b->desired_rx = E.desired_rx;
+  b->rx = E.rx;
+  b->row_off = E.row_off;
+  b->wrap_sub = E.wrap_sub;
+  b->wrap_width = E.wrap.width;
+  b->col_off = E.col_off;
+  b->dirty = E.dirty;
+  b->num_rows = E.num_rows;
+  b->row = E.row;
+  b->filename = E.filename;
+  b->syntax = E.syntax;
+  b->loader = E.loader;
+  b->line_base = E.line_base;
+  b->window_start = E.window_start;
+  b->window_loaded = E.window_loaded;
+}
+
+// Make a stashed buffer's state the current one.
+void editor_restore_buffer(const struct editor_buffer* b) {
+  E.cx = b->cx;
+  E.cy = b->cy;
+  E.desired_rx = b->desired_rx;
+  E.rx = b->rx;
+  E.row_off = b->row_off;
+  E.wrap_sub = b->wrap_sub;
+  wrap_invalidate();
+  E.wrap.width = b->wrap_width; // so that the rows are rewrapped if need be
+  E.col_off = b->col_off;
+  E.dirty = b->dirty;
+  E.num_rows = b->num_rows;
+  E.row = b->row;
+  E.filename = b->filename;
+  E.syntax = b->syntax;
+  E.loader = b->loader;
+  E.line_base = b->line_base;
+  E.window_start = b->window_start;
+  E.window_loaded = b->window_loaded;
+}
+
+// Make buffer i the current buffer.
+void editor_switch_buffer(int i) {
+  if((i < 0) || (i >= E.num_buffers) || (i == E.cur_buffer)) { return; }
+
+  editor_stash_buffer(&E.buffers[E.cur_buffer]);
+  editor_restore_buffer(&E.buffers[i]);
+  E.cur_buffer = i;
+  editor_damage_all();
+}
+
+// Add a new, empty, buffer and make it current.
+void editor_new_buffer(void) {
+  editor_stash_buffer(&E.buffers[E.cur_buffer]);
+
+  E.buffers = xrealloc(E.buffers, sizeof(struct editor_buffer) * (E.num_buffers + 1));
+
+  memset(&E.buffers[E.num_buffers], 0, sizeof(struct editor_buffer));
+  E.buffers[E.num_buffers].line_base = -1;
+  E.cur_buffer = E.num_buffers++;
+  editor_restore_buffer(&E.buffers[E.cur_buffer]);
+}
+
+// Returns non-zero if any buffer has unsaved changes.
+int editor_any_dirty(void) {
+  for(int i=0; i<E.num_buffers; ++i) {
+    int dirty = (i == E.cur_buffer) ? E.dirty : E.buffers[i].dirty;
+    if(dirty) { return 1; }
+  }
+  return 0;
+}
+
+// Build a prompt listing the open buffers.
+void editor_buffer_list_prompt(char* buf, size_t size) {
+  size_t len = snprintf(buf, size, "Buffer [");
+
+  for(int i=0; (i<E.num_buffers) && (len + 1 < size); ++i) {
+    const char* name = (i == E.cur_buffer) ? E.filename : E.buffers[i].filename;
+    int dirty = (i == E.cur_buffer) ? E.dirty : E.buffers[i].dirty;
+    len += snprintf(&buf[len], size - len, "%s%d:%s%s", i ? " " : "", i + 1,
+        name ? name : "[No Name]", dirty ? "+" : "");
+  }
+
+  // leave room for the rest of the prompt
+  if(len + 8 >= size) { len = size - 8; }
+
+  // the prompt is a format string so escape any '%' in file names
+  for(size_t i=0; i<len; ++i) {
+    if(buf[i] == '%') { buf[i] = '?'; }
+  }
+  strcpy(&buf[len], "]: %s");
+}
+
+// Prompt for a buffer by number or part of its name and switch to it.
+void editor_choose_buffer(void) {
+  char prompt[sizeof(E.status_msg)];
+  editor_buffer_list_prompt(prompt, sizeof(prompt));
+
+  char* query = editor_prompt(prompt, NULL);
+  if(query == NULL) { return; }
+
+  // buffer number?
+  char* end;
+  long n = strtol(query, &end, 10);
+  if((*end == '\0') && (n >= 1) && (n <= E.num_buffers)) {
+    editor_switch_buffer(n - 1);
+    free(query);
+    return;
+  }
+
+  // name?
+  for(int i=0; i<E.num_buffers; ++i) {
+    const char* name = (i == E.cur_buffer) ? E.filename : E.buffers[i].filename;
+    if(name && strstr(name, query)) {
+      editor_switch_buffer(i);
+      free(query);
+      return;
+    }
+  }
+
+  editor_set_status_message("No buffer matches \"%s\"", query);
+  free(query);
+}
+
+//// BACKGROUND LOADING
+
+// Update a loader's state and flag the change to the editor. Must be called
+// with the pool lock held.
+void loader_set_state(struct file_loader* ld, int state) {
+  ld->state = state;
+  ld->news = 1;
+  E.pool.news = 1;
+}
+
+// Seek to the loader's target line, if any, and then load and index the whole
+// file.
+void loader_run(struct file_loader* ld) {
+  struct file_map fm;
+  if(-1 == file_map_open(&fm, ld->filename, 1)) {
+    pthread_mutex_lock(&E.pool.lock);
+    ld->err = errno;
+    loader_set_state(ld, LOADER_FAILED);
+    pthread_mutex_unlock(&E.pool.lock);
+    return;
+  }
+
+  // Counting newlines is much faster than indexing so find the target first
+  // and let the editor show it while we do the rest.
+  if(ld->target_line > 0) {
+    uint64_t found;
+    uint64_t offset = find_line_offset(fm.data, fm.size, ld->target_line,
+        &found);
+    pthread_mutex_lock(&E.pool.lock);
+    ld->target_offset = offset;
+    ld->found_line = found;
+    loader_set_state(ld, LOADER_LOADING);
+    pthread_mutex_unlock(&E.pool.lock);
+  }
+
+  struct line_index idx;
+  line_index_build(&idx, ld->filename, &fm);
+
+  erow* rows;
+  int num_rows;
+  editor_build_rows(fm.data, fm.size, &idx, ld->syntax, &rows, &num_rows);
+  file_map_close(&fm);
+
+  pthread_mutex_lock(&E.pool.lock);
+  ld->rows = rows;
+  ld->num_rows = num_rows;
+  ld->idx = idx;
+  loader_set_state(ld, LOADER_DONE);
+  pthread_mutex_unlock(&E.pool.lock);
+}
+
+// Body of each loader pool thread. Threads run queued loaders until there are
+// none left.
+void* loader_pool_thread(void* arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&E.pool.lock);
+  while(E.pool.next_job < E.pool.num_jobs) {
+    struct file_loader* ld = E.pool.jobs[E.pool.next_job++];
+    pthread_mutex_unlock(&E.pool.lock);
+    loader_run(ld);
+    pthread_mutex_lock(&E.pool.lock);
+  }
+
+  // queue is drained
+  E.pool.num_jobs = E.pool.next_job = 0;
+  E.pool.num_threads--;
+  pthread_mutex_unlock(&E.pool.lock);
+
+  return NULL;
+}
+
+// Queue a loader to be run by the pool, starting a thread for it if there's
+// room for one.
+void loader_pool_submit(struct file_loader* ld) {
+  pthread_mutex_lock(&E.pool.lock);
+
+  E.pool.jobs = xrealloc(E.pool.jobs,
+      sizeof(struct file_loader*) * (E.pool.num_jobs + 1));
+  E.pool.jobs[E.pool.num_jobs++] = ld;
+
+  if(E.pool.num_threads < KILO_LOADER_THREADS) {
+    pthread_t thread;
+    if(0 != pthread_create(&thread, NULL, loader_pool_thread, NULL)) {
+      die("pthread_create");
+    }
+    pthread_detach(thread);
+    E.pool.num_threads++;
+  }
+
+  pthread_mutex_unlock(&E.pool.lock);
+}
+
+// Create a loader for a file and queue it.
+struct file_loader* loader_start(const char* filename,
+    struct editor_syntax* syntax, uint64_t target_line, int state) {
+  struct file_loader* ld = xcalloc(1, sizeof(struct file_loader));
+
+  ld->filename = xstrdup(filename);
+  ld->syntax = syntax;
+  ld->target_line = target_line;
+  ld->state = state;
+
+  loader_pool_submit(ld);
+  return ld;
+}
+
+// Free a loader which has finished.
+void loader_free(struct file_loader* ld) {
+  line_index_free(&ld->idx);
+  free(ld->filename);
+  free(ld);
+}
+
+// Returns non-zero if any background loader has news for the editor.
+int editor_loader_has_news(void) {
+  pthread_mutex_lock(&E.pool.lock);
+  int news = E.pool.news;
+  pthread_mutex_unlock(&E.pool.lock);
+  return news;
+}
+
+// Returns non-zero, after telling the user, if the buffer may not be modified.
+int editor_is_read_only(void) {
+  if(!E.loader) { return 0; }
+  editor_set_status_message("Buffer is read-only until loading completes");
+  return 1;
+}
+
+// Load only the lines around an offset within a file. The line containing the
+// offset is given by line if known, otherwise line is -1.
+void editor_load_window(struct file_map* fm, uint64_t offset, int line) {
+  const uint8_t* data = fm->data;
+  if(offset >= fm->size) { offset = fm->size ? fm->size - 1 : 0; }
+
+  // find the start of the line containing offset ...
+  const uint8_t* p = memrchr(data, '\n', offset);
+  uint64_t target_start = p ? (uint64_t)(p - data + 1) : 0;
+
+  // ... then walk backwards for the start of the window ...
+  uint64_t start = target_start;
+  int before = 0;
+  while((start > 0) && (before < KILO_WINDOW_LINES)) {
+    p = memrchr(data, '\n', start - 1);
+    start = p ? (uint64_t)(p - data + 1) : 0;
+    ++before;
+  }
+
+  // ... and forwards for its end
+  uint64_t end = target_start;
+  for(int i=0; (i <= KILO_WINDOW_LINES) && (end < fm->size); ++i) {
+    p = memchr(&data[end], '\n', fm->size - end);
+    end = p ? (uint64_t)(p - data + 1) : fm->size;
+  }
+
+  struct line_index idx;
+  memset(&idx, 0, sizeof(idx));
+  line_index_scan(&idx, &data[start], 0, end - start);
+
+  erow* rows;
+  int num_rows;
+  editor_build_rows(&data[start], end - start, &idx, E.syntax, &rows, &num_rows);
+  editor_set_rows(rows, num_rows);
+  line_index_free(&idx);
+
+  E.window_start = start;
+  E.window_loaded = 1;
+  E.line_base = (line >= 0) ? line - before : -1;
+
+  // place the cursor at the offset with the target row a third of the way down
+  E.cy = before;
+  E.cx = offset - target_start;
+  if((E.cy < E.num_rows) && (E.cx > E.row[E.cy].size)) {
+    E.cx = E.row[E.cy].size;
+  }
+  E.row_off = E.cy - E.screen_rows / 3;
+  if(E.row_off < 0) { E.row_off = 0; }
+}
+
+// Act upon any news from the current buffer's background loader.
+void editor_loader_poll(void) {
+  struct file_loader* ld = E.loader;
+
+  pthread_mutex_lock(&E.pool.lock);
+  int state = ld->state;
+  int news = ld->news;
+  uint64_t target_offset = ld->target_offset;
+  int found_line = ld->found_line;
+  ld->news = 0;
+  pthread_mutex_unlock(&E.pool.lock);
+
+  if(!news) { return; }
+
+  if((state == LOADER_LOADING) && (ld->target_line > 0) && !E.window_loaded) {
+    struct file_map fm;
+    if(0 == file_map_open(&fm, ld->filename, 0)) {
+      editor_load_window(&fm, target_offset, found_line);
+      file_map_close(&fm);
+    }
+  } else if(state == LOADER_FAILED) {
+    editor_set_status_message("error loading %.20s: %s", ld->filename,
+        strerror(ld->err));
+
+    // A partially loaded window must stay read-only so that saving it can't
+    // truncate the file.
+    if(!E.window_loaded) {
+      loader_free(ld);
+      E.loader = NULL;
+    }
+  } else if(state == LOADER_DONE) {
+    // Work out where the window was in the whole file so that the cursor and
+    // scroll position can be kept.
+    int line = 0;
+    if(E.window_loaded) {
+      line = (E.line_base >= 0) ?
+        E.line_base : (int)line_index_find(&ld->idx, E.window_start);
+    } else if(ld->target_line > 0) {
+      E.cy = found_line;
+      E.cx = 0;
+      E.row_off = E.cy - E.screen_rows / 3;
+      if(E.row_off < 0) { E.row_off = 0; }
+    }
+
+    editor_set_rows(ld->rows, ld->num_rows);
+    E.cy += line;
+    E.row_off += line;
+    if(E.cy > E.num_rows) { E.cy = E.num_rows; }
+    if(E.row_off > E.cy) { E.row_off = E.cy; }
+
+    loader_free(ld);
+    E.loader = NULL;
+    E.window_loaded = 0;
+    E.line_base = -1;
+    E.dirty = 0;
+
+    editor_set_status_message("Loaded %.20s: %d lines", E.filename, E.num_rows);
+  }
+}
+
+// Act upon news from the background loaders of every buffer.
+void editor_poll_loaders(void) {
+  pthread_mutex_lock(&E.pool.lock);
+  E.pool.news = 0;
+  pthread_mutex_unlock(&E.pool.lock);
+
+  int cur_buffer = E.cur_buffer;
+  int loading = 0;
+  for(int i=0; i<E.num_buffers; ++i) {
+    editor_switch_buffer(i);
+    if(E.loader) { editor_loader_poll(); }
+    if(E.loader) { loading = 1; }
+  }
+  editor_switch_buffer(cur_buffer);
+
+  if(!loading) { stats_loaded(); }
+}
+
+// Open a file at a particular line (1-based, 0 for none) or byte offset (-1 for
+// none). Only the lines around the target are loaded before returning; the
+// rest of the file is loaded in the background.
+void editor_open_at(const char* filename, uint64_t line, int64_t offset) {
+  struct file_map fm;
+  if(-1 == file_map_open(&fm, filename, 0)) { die("open"); }
+
+  // Small and unmappable files are simply loaded in full
+  if(!fm.mapped || (fm.size < KILO_INDEX_MIN_SIZE)) {
+    // Find the line containing an offset from the bytes themselves, since
+    // they, unlike the rows, say how long each line ending is
+    uint64_t offset_line = 0, offset_col = 0;
+    if(offset >= 0) {
+      uint64_t end = ((uint64_t)offset < fm.size) ? (uint64_t)offset : fm.size;
+      const uint8_t* p = end ? memrchr(fm.data, '\n', end) : NULL;
+      offset_line = count_byte(fm.data, end, '\n');
+      offset_col = end - (p ? (uint64_t)(p - fm.data + 1) : 0);
+    }
+    file_map_close(&fm);
+    editor_open(filename);
+
+    if(line > 0) {
+      E.cy = ((int64_t)line > E.num_rows) ? E.num_rows : (int)line - 1;
+    } else if(offset >= 0) {
+      E.cy = (offset_line > (uint64_t)E.num_rows) ?
+        E.num_rows : (int)offset_line;
+      E.cx = 0;
+      if(E.cy < E.num_rows) {
+        E.cx = (offset_col > (uint64_t)E.row[E.cy].size) ?
+          E.row[E.cy].size : (int)offset_col;
+      }
+    }
+    E.row_off = E.cy - E.screen_rows / 3;
+    if(E.row_off < 0) { E.row_off = 0; }
+    return;
+  }
+
+  free(E.filename);
+  E.filename = xstrdup(filename);
+  E.syntax = editor_syntax_for_filename(E.filename);
+
+  // An up to date sidecar lets us seek directly
+  struct line_index idx;
+  memset(&idx, 0, sizeof(idx));
+  int target = -1;
+  if(-1 != line_index_load_sidecar(&idx, filename, &fm)) {
+    if(line > 0) {
+      target = (line > idx.num_lines) ? idx.num_lines - 1 : line - 1;
+      offset = idx.starts[target];
+    } else {
+      target = line_index_find(&idx, offset);
+    }
+  }
+  line_index_free(&idx);
+
+  if(offset >= 0) { editor_load_window(&fm, offset, target); }
+  file_map_close(&fm);
+
+  // Load everything else in the background
+  E.loader = loader_start(filename, E.syntax, (offset >= 0) ? 0 : line,
+      (offset >= 0) ? LOADER_LOADING : LOADER_SEEKING);
+  E.dirty = 0;
+}
+
+// Open several files, each into its own buffer, loading them in parallel in the
+// background. The first file's buffer is made current and is opened at the
+// given line or offset, if any.
+void editor_open_many(char** filenames, int num_files, uint64_t line,
+    int64_t offset) {
+  for(int i=0; i<num_files; ++i) {
+    // the initial buffer is re-used for the first file
+    if(i > 0) { editor_new_buffer(); }
+
+    if((i == 0) && ((line > 0) || (offset >= 0))) {
+      editor_open_at(filenames[i], line, offset);
+      continue;
+    }
+
+    E.filename = xstrdup(filenames[i]);
+    E.syntax = editor_syntax_for_filename(E.filename);
+    E.loader = loader_start(filenames[i], E.syntax, 0, LOADER_LOADING);
+  }
+
+  editor_switch_buffer(0);
+}
+
 //// FIND
 
 void editor_find_callback(char *query, int key) {
@@ -1128,6 +5130,7 @@ void editor_find_callback(char *query, int key) {
   // If there was a saved hl line from a previous match, restore it
   if(saved_hl) {
     memcpy(E.row[saved_hl_row].hl, saved_hl, E.row[saved_hl_row].r_size);
+    editor_damage_row(saved_hl_row);
     free(saved_hl);
     saved_hl = NULL;
   }
@@ -1167,11 +5170,12 @@ void editor_find_callback(char *query, int key) {
 
       // Save hl before tagging
       saved_hl_row = current_row;
-      saved_hl = malloc(row->r_size);
+      saved_hl = xmalloc(row->r_size);
       memcpy(saved_hl, row->hl, row->r_size);
 
       // Tag matched region
       memset(&row->hl[match_rx], HL_MATCH, strlen(query));
+      editor_damage_row(current_row);
 
       return;
     } else {
@@ -1260,6 +5264,15 @@ void editor_process_key(void) {
   static int quit_times = KILO_QUIT_TIMES; // quit time counter
   int c = editor_read_key();
 
+  // Replies from the terminal and timers are handled as they're read, and the
+  // end of input by the input loop
+  if((c == TERM_REPLY_KEY) || (c == TIMER_KEY) || (c == INPUT_END_KEY)) {
+    return;
+  }
+
+  // Anything else may change what's on screen
+  E.frame_pending = 1;
+
   // Was this a vertical movement command?
   int was_vert = 0;
 
@@ -1268,12 +5281,22 @@ void editor_process_key(void) {
 
   switch(c) {
     case TERM_RESIZE_KEY:
-      // all we need to do is re-render screen
-      E.term_resized = 0;
+      // the new size is laid out before the next frame
+      break;
+
+    case LOADER_KEY:
+      editor_poll_loaders();
+      break;
+
+    case CHILD_EXIT_KEY:
+      editor_reap_save();
       break;
     
     case CTRL_KEY('q'):
-      if(E.dirty && (quit_times > 0)) {
+      // A save in flight decides whether the buffers are dirty. If it fails,
+      // the error is left showing.
+      if(-1 == editor_wait_for_save()) { return; }
+      if(editor_any_dirty() && (quit_times > 0)) {
         editor_set_status_message("File has unsaved changes. "
             "Press Ctrl-Q %d more time%s to quit.",
             quit_times, quit_times == 1 ? "" : "s");
@@ -1291,8 +5314,41 @@ void editor_process_key(void) {
       editor_find();
       break;
 
+    case CTRL_KEY('n'):
+      editor_switch_buffer((E.cur_buffer + 1) % E.num_buffers);
+      break;
+
+    case CTRL_KEY('p'):
+      editor_switch_buffer((E.cur_buffer + E.num_buffers - 1) % E.num_buffers);
+      break;
+
+    case CTRL_KEY('b'):
+      editor_choose_buffer();
+      break;
+
+    case CTRL_KEY('w'):
+      editor_toggle_wrap();
+      break;
+
+    case CTRL_KEY('t'):
+      editor_show_stats();
+      break;
+
+    case CTRL_KEY('g'):
+      editor_toggle_cost_overlay();
+      break;
+
+    case CTRL_KEY('o'):
+      editor_toggle_line_numbers();
+      break;
+
     case CTRL_KEY('k'):
-      editor_del_row(E.cy);
+      if(!editor_is_read_only()) {
+        editor_del_row(E.cy);
+        // snap cx to the row which took the deleted one's place
+        int rowlen = (E.cy < E.num_rows) ? E.row[E.cy].size : 0;
+        if(E.cx > rowlen) { E.cx = rowlen; }
+      }
       break;
 
     // Enter
@@ -1308,8 +5364,14 @@ void editor_process_key(void) {
       editor_del_char();
       break;
 
-    // Escape
+    // Redraw everything
     case CTRL_KEY('l'):
+      // Forget what is on the terminal so that it is repainted from scratch
+      E.repaint = 1;
+      editor_damage_all();
+      break;
+
+    // Escape
     case ESCAPE_KEY:
       // Ignore
       break;
@@ -1333,6 +5395,7 @@ void editor_process_key(void) {
           E.cy = E.row_off;
         } else if(c == PAGE_DOWN) {
           E.cy = E.row_off + E.screen_rows - 1;
+          if(E.cy > E.num_rows) { E.cy = E.num_rows; }
         }
 
         // Simulate multiple arrow key presses. Takes care of correcting any
@@ -1376,23 +5439,26 @@ void editor_process_key(void) {
 char* editor_prompt(char* prompt, prompt_cb cb) {
   // allocate input buffer
   size_t buf_size = 128;
-  char* buf = malloc(buf_size);
+  char* buf = xmalloc(buf_size);
 
   // initialise buffer
   size_t buf_len = 0;
   buf[0] = '\0';
 
+  E.prompting = 1;
   while(1) {
     editor_set_status_message(prompt, buf);
-    editor_refresh_screen();
+    editor_update_screen();
 
     // super simple line editor
     int c = editor_read_key();
+    if(c == INPUT_END_KEY) { c = ESCAPE_KEY; } // there's no answer coming
     if((c == ESCAPE_KEY) || (c == CTRL_KEY('c'))) {
       // cancel on escape / Ctrl-C
       editor_set_status_message("");
       if(cb) { cb(buf, c); }
       free(buf);
+      E.prompting = 0;
       return NULL;
     } else if(c == BACKSPACE) {
       if(buf_len == 0) { continue; }
@@ -1402,13 +5468,14 @@ char* editor_prompt(char* prompt, prompt_cb cb) {
       if(buf_len != 0) {
         editor_set_status_message("");
         if(cb) { cb(buf, c); }
+        E.prompting = 0;
         return buf;
       }
     } else if(!iscntrl(c) && (c <= 0xff)) {
       // realloc buffer if necessary
       if(buf_len == buf_size - 1) {
         buf_size *= 2;
-        buf = realloc(buf, buf_size);
+        buf = xrealloc(buf, buf_size);
       }
       buf[buf_len++] = c;
       buf[buf_len] = '\0';
@@ -1421,30 +5488,58 @@ char* editor_prompt(char* prompt, prompt_cb cb) {
 
 //// MAIN LOOP
 
+// SIGWINCH handler for when there's no signalfd. The resize is handled by
+// the event loop.
 void terminal_resized(int sig) {
   if(sig != SIGWINCH) { return; }
+  E.term_resized = 1;
+}
 
-  // Obtain terminal window size
-  if(-1 == get_window_size(&E.screen_rows, &E.screen_cols)) {
-    die("window size");
+// Decide whether to draw a frame now. Keys which have already arrived are
+// handled first so that a burst of input is drawn once. Frames are drawn no
+// more often than the frame interval: if the last one was too recent, wait out
+// the rest of the interval for more input before drawing. Once the interval
+// has passed a frame is drawn even if input is waiting, so that the screen
+// keeps up with a long paste. A zero interval means drain all input first.
+int editor_frame_due(void) {
+  if(!E.frame_pending) { return 0; }
+
+  uint64_t since = now_ns() - E.last_frame;
+  int wait = 0;
+
+  if(E.frame_interval && (since >= E.frame_interval)) { return 1; }
+  if(since < E.frame_interval) {
+    wait = (E.frame_interval - since + 999999) / 1000000;
   }
 
-  // Make room for status bar and message
-  E.screen_rows -= 2;
-
-  if(E.screen_rows < 1) {
-    die("terminal too small");
+  if(editor_input_pending(wait)) {
+    ++E.stats.skipped_frames;
+    return 0;
   }
+  return 1;
+}
 
-  // Set flag
-  E.term_resized = 1;
+// Draw a frame if the frame scheduler says one is due.
+void editor_update_screen(void) {
+  if(editor_frame_due()) { editor_refresh_screen(); }
+}
+
+void child_exited(int sig) {
+  if(sig != SIGCHLD) { return; }
+  E.child_exited = 1;
 }
 
 void init_editor(void) {
-  // Get initial size of terminal and register terminal size change handler
-  terminal_resized(SIGWINCH);
-  E.term_resized = 0;
-  signal(SIGWINCH, terminal_resized);
+  // Get initial size of terminal and watch for it changing
+  editor_get_size(&E.screen_rows, &E.screen_cols);
+  terminal_watch_resize();
+  E.resize_pending = 0;
+  E.last_cursor_y = 0;
+
+  // Background saves are reaped when they signal they're done
+  E.save_pid = 0;
+  E.child_exited = 0;
+  signal(SIGCHLD, child_exited);
   
   // Reset cursor position
   E.rx = E.cx = E.cy = 0;
@@ -1456,49 +5551,187 @@ void init_editor(void) {
   E.num_rows = 0;
   E.row = NULL;
 
+  // Not wrapping
+  E.wrap_mode = 0;
+  E.wrap_sub = E.wrap_top = E.last_wrap_top = 0;
+  memset(&E.wrap, 0, sizeof(E.wrap));
+
   // No file
   E.filename = NULL;
 
   // No status
   E.status_msg[0] = '\0';
-  E.status_msg_time = 0;
+  E.status_msg_expiry = 0;
 
   // Not dirty
   E.dirty = 0;
 
   // No syntax
   E.syntax = NULL;
+
+  // Not loading
+  E.loader = NULL;
+  E.window_loaded = 0;
+  E.line_base = -1;
+  E.prompting = 0;
+  E.input_ended = 0;
+  pthread_mutex_init(&E.pool.lock, NULL);
+  E.pool.jobs = NULL;
+  E.pool.num_jobs = E.pool.next_job = E.pool.num_threads = 0;
+  E.pool.news = 0;
+
+  // Nothing drawn yet
+  E.damage = NULL;
+  E.damage_rows = 0;
+  E.gutter_labels = NULL;
+  E.line_numbers = LINE_NUMBERS_OFF;
+  E.gutter = 0;
+  E.text_cols = E.screen_cols;
+  E.last_cy = 0;
+  E.full_redraw = 1;
+  memset(&E.back, 0, sizeof(E.back));
+  E.repaint = 0;
+  E.scroll_delta = 0;
+  theme_load();
+  render_start();
+  E.last_frame = 0;
+  E.frame_pending = 1;
+
+  // Find out what the terminal supports
+  E.term_caps = terminal_caps_from_env();
+  E.term->query();
+
+  // A single, empty, buffer
+  E.buffers = xcalloc(1, sizeof(struct editor_buffer));
+  E.num_buffers = 1;
+  E.cur_buffer = 0;
+}
+
+// Parse a "+LINE" or "@OFFSET" startup option. Offsets may have a K, M or G
+// suffix. Returns 0 iff arg was such an option.
+int parse_position_arg(const char* arg, uint64_t* line, int64_t* offset) {
+  if((arg[0] != '+') && (arg[0] != '@')) { return -1; }
+  if(!isdigit((uint8_t)arg[1])) { return -1; }
+
+  char* end;
+  errno = 0;
+  unsigned long long v = strtoull(&arg[1], &end, 10);
+  if(errno != 0) { return -1; }
+
+  if(arg[0] == '+') {
+    if((*end != '\0') || (v == 0) || (v > INT32_MAX)) { return -1; }
+    *line = v;
+    return 0;
+  }
+
+  int shift = 0;
+  switch(*end) {
+    case '\0': break;
+    case 'k': case 'K': shift = 10; ++end; break;
+    case 'm': case 'M': shift = 20; ++end; break;
+    case 'g': case 'G': shift = 30; ++end; break;
+    default: return -1;
+  }
+  if((*end != '\0') || (v > ((unsigned long long)INT64_MAX >> shift))) {
+    return -1;
+  }
+  *offset = v << shift;
+  return 0;
 }
 
 int main(int argc, char** argv) {
-  // Save original terminal config for restore_terminal() to use
-  if(-1 == tcgetattr(STDIN_FILENO, &E.orig_termios)) {
-    die("tcgetattr");
+  // Parse startup options
+  uint64_t line = 0;
+  int64_t offset = -1;
+  long max_fps = KILO_MAX_FPS;
+  int headless_rows = 0, headless_cols = 0;
+  int bad_usage = 0;
+  int arg = 1;
+  for(; arg < argc; ++arg) {
+    if(!strcmp(argv[arg], "--stats")) {
+      E.stats.enabled = 1;
+    } else if(!strcmp(argv[arg], "--max-fps")) {
+      if(arg + 1 == argc) { bad_usage = 1; break; }
+      char* end;
+      const char* value = argv[++arg];
+      errno = 0;
+      max_fps = strtol(value, &end, 10);
+      if((end == value) || (*end != '\0') || (errno != 0) || (max_fps < 0)) {
+        bad_usage = 1;
+      }
+    } else if(!strcmp(argv[arg], "--headless")) {
+      if(arg + 1 == argc) { bad_usage = 1; break; }
+      char x;
+      if((3 != sscanf(argv[++arg], "%d%c%d", &headless_cols, &x,
+              &headless_rows)) || (x != 'x') || (headless_cols < 1) ||
+          (headless_rows < 3)) {
+        bad_usage = 1;
+      }
+    } else if(0 != parse_position_arg(argv[arg], &line, &offset)) {
+      break;
+    }
+  }
+  if(bad_usage || ((line > 0) && (offset >= 0))) {
+    fprintf(stderr, "usage: %s [--stats] [--max-fps N] [--headless COLSxROWS] "
+        "[+LINE | @OFFSET] [file...]\n", argv[0]);
+    return EXIT_FAILURE;
   }
+  E.stats.start = stats_begin();
 
-  // Register restore_terminal() as an atexit handler so that the terminal is
-  // restored when we terminate.
-  atexit(restore_terminal);
+  // Register stats_report() before restore_terminal() so that it runs after
+  // the terminal is restored.
+  atexit(stats_report);
 
-  // Move to "raw" mode for the terminal.
-  enable_raw_mode();
+  // Run in the controlling terminal or, with --headless, one emulated in
+  // memory which is fed keys from stdin
+  if(headless_rows) {
+    vt_init(headless_rows, headless_cols);
+    E.term = &vt_backend;
+  } else {
+    E.term = &tty_backend;
+  }
+
+  // Move to "raw" mode for the terminal and register an atexit handler so
+  // that the terminal is restored when we terminate.
+  uint64_t t = stats_begin();
+  E.term->open();
+  atexit(E.term->close);
 
   // Initialise editor
   init_editor();
-
-  // Load file if specified
-  if(argc >= 2) {
-    editor_open(argv[1]);
+  stats_end(&E.stats.init, t);
+
+  // A headless terminal draws every frame so that what each one costs is
+  // predictable
+  E.render.lockstep = (headless_rows != 0);
+
+  // Load files if specified. Several files are loaded in parallel and any
+  // position applies to the first.
+  if(argc - arg > 1) {
+    editor_open_many(&argv[arg], argc - arg, line, offset);
+  } else if(arg < argc) {
+    if((line > 0) || (offset >= 0)) {
+      editor_open_at(argv[arg], line, offset);
+    } else {
+      editor_open(argv[arg]);
+    }
   }
 
-  // Set a helpful status message
-  editor_set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+  // Set a helpful status message, unless there's a problem to report
+  if(!E.status_msg[0]) {
+    editor_set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | "
+        "Ctrl-F = find | Ctrl-B = buffers");
+  }
 
-  // Input loop.
-  while(1) {
-    editor_refresh_screen();
+  // Input loop. Frames are drawn by the frame scheduler.
+  E.frame_interval = max_fps ? 1000000000 / max_fps : 0;
+  while(!E.input_ended) {
+    editor_update_screen();
     editor_process_key();
   }
 
+  // Input has ended: bring the screen up to date and let any save finish
+  if(E.frame_pending) { editor_refresh_screen(); }
+  editor_wait_for_save();
   return EXIT_SUCCESS;
 }
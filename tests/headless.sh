@@ -0,0 +1,50 @@
+#!/bin/sh
+# Run kilo --headless over each case and compare the screen, cursor position
+# and bytes per frame it prints with the expected output in tests/headless.
+#
+#   tests/headless.sh [path to kilo]
+#
+# With UPDATE=1 in the environment, the expected output is rewritten instead.
+
+kilo=$(cd "$(dirname "${1:-./kilo}")" && pwd)/$(basename "${1:-./kilo}")
+dir=$(cd "$(dirname "$0")/headless" && pwd)
+
+# Keep the user's theme, terminal and caches out of it
+home=$(mktemp -d) || exit 1
+trap 'rm -rf "$home"' EXIT
+export HOME="$home" XDG_CACHE_HOME="$home/cache" TERM=xterm
+unset KILO_THEME COLORTERM
+
+failed=0
+
+# check NAME SIZE KEYS FILE...
+check() {
+  name=$1 size=$2 keys=$3
+  shift 3
+  out="$home/$name.out"
+  (cd "$dir" && printf "$keys" | "$kilo" --headless "$size" "$@") > "$out"
+
+  if [ -n "$UPDATE" ]; then
+    cp "$out" "$dir/$name.out"
+  elif cmp -s "$out" "$dir/$name.out"; then
+    echo "ok $name"
+  else
+    echo "FAIL $name"
+    diff -u "$dir/$name.out" "$out"
+    failed=1
+  fi
+}
+
+# typing into a highlighted file
+check type 40x8 'abc\033[B\033[Bzz' t.c
+
+# scrolling a page at a time, and back by a line
+check scroll 40x10 '\033[6~\033[6~\033[A\033[A\033[A\033[A\033[A\033[A\033[A\033[A\033[A' long.txt
+
+# soft wrapping, with line numbers
+check wrap 30x10 '\027\017\033[6~x\033[A\033[Ay' long.txt
+
+# a search cancelled by the end of input
+check find 40x8 '\006printf' t.c
+
+exit $failed
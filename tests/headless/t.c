@@ -0,0 +1,11 @@
+#include <stdio.h>
+
+/* Print a greeting, then count to three. */
+int main(void) {
+  const char* who = "world";
+  printf("hello, %s\n", who);
+  for(int i=1; i<=3; ++i) {
+    printf("%d\n", i); // one per line
+  }
+  return 0;
+}